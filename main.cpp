@@ -1,26 +1,280 @@
+#include <chrono>
+#include <thread>
+
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/ADT/ScopeExit.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/ProfileData/InstrProfReader.h>
 #include <llvm/MC/TargetRegistry.h>
-#include <llvm/IR/LegacyPassManager.h>
 #include <llvm/TargetParser/Host.h>
+#include <llvm/TargetParser/SubtargetFeature.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
 #include <llvm/Target/TargetOptions.h>
 #include <llvm/Target/TargetMachine.h>
 
 #include "src/parser.h"
 #include "src/interpreter.h"
 #include "src/codegen.h"
+#include "src/emit.h"
+#include "src/jit.h"
+#include "src/lto.h"
+#include "src/memstats.h"
+#include "src/runtime.h"
+#include "src/server.h"
 
-extern "C" double putchard(double X) {
-  fputc((char)X, stderr);
-  return 0;
+static llvm::cl::OptionCategory KaleidoscopeCategory("Kaleidoscope options");
+
+static llvm::cl::opt<std::string> MCPU("mcpu",
+  llvm::cl::desc("Target CPU to compile for, or 'native' for the host CPU"),
+  llvm::cl::value_desc("cpu"), llvm::cl::init("generic"), llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<std::string> MAttrs("mattr",
+  llvm::cl::desc("Target features, e.g. +avx2,+fma"),
+  llvm::cl::value_desc("a1,+a2,-a3,..."), llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<EmitKind> Emit("emit",
+  llvm::cl::desc("Kind of output to write"), llvm::cl::init(EmitObject),
+  llvm::cl::values(
+    clEnumValN(EmitObject, "obj", "Relocatable object file (default)"),
+    clEnumValN(EmitAssembly, "asm", "Target assembly"),
+    clEnumValN(EmitBitcode, "bc", "LLVM bitcode"),
+    clEnumValN(EmitIR, "ll", "Textual LLVM IR"),
+    clEnumValN(EmitShared, "so", "Shared library, linked with cc")),
+  llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<std::string> OutputFilename("o",
+  llvm::cl::desc("Output file (default: output.<ext> for the -emit kind)"),
+  llvm::cl::value_desc("filename"), llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::list<std::string> InputFiles(llvm::cl::Positional,
+  llvm::cl::desc("<input files, or - for stdin; compiled as separate units>"), llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<LTOKind> LTO("lto",
+  llvm::cl::desc("Optimize across input files"), llvm::cl::init(LTONone),
+  llvm::cl::values(
+    clEnumValN(LTONone, "none", "Link units after optimizing them separately (default)"),
+    clEnumValN(LTOFull, "full", "Link units into one module and optimize it as a whole"),
+    clEnumValN(LTOThin, "thin", "Optimize units in parallel with ThinLTO")),
+  llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::list<std::string> Exports("export",
+  llvm::cl::desc("Functions called from outside the program; with -lto the others may be inlined and dropped"),
+  llvm::cl::value_desc("name,..."), llvm::cl::CommaSeparated, llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<unsigned> LTOJobs("lto-jobs",
+  llvm::cl::desc("ThinLTO backend threads (default: hardware threads)"),
+  llvm::cl::init(0), llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<unsigned> Jobs("j",
+  llvm::cl::desc("Threads generating and optimizing the functions of each input file and generating the "
+                 "machine code of the output (default: 1, 0 for hardware threads)"),
+  llvm::cl::init(1), llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<bool> MemStats("mem-stats",
+  llvm::cl::desc("Print the allocated bytes and the peak RSS after parsing, IR generation, optimization and "
+                 "emission"),
+  llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<bool> ShareSubexpressions("share-subexpressions",
+  llvm::cl::desc("Share repeated subexpressions within a definition and generate the pure ones once; saves "
+                 "memory and IR generation time on generated sources, at some parse time"),
+  llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<bool> ReplStats("repl-stats",
+  llvm::cl::desc("Print the number of evaluated expressions and the module size on exit"),
+  llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<std::string> LoadSnapshotFile("load-snapshot",
+  llvm::cl::desc("Restore operators, prototypes and definitions from a snapshot before reading stdin"),
+  llvm::cl::value_desc("file"), llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<std::string> SaveSnapshotFile("save-snapshot",
+  llvm::cl::desc("Save operators, prototypes and definitions to a snapshot after reading stdin"),
+  llvm::cl::value_desc("file"), llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<std::string> ProfileGenerate("fprofile-generate",
+  llvm::cl::desc("Instrument the output to count branches and calls; programs linked with the profile runtime "
+                 "write the counts to the given file (default: default_%m.profraw)"),
+  llvm::cl::value_desc("file"), llvm::cl::ValueOptional, llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<std::string> ProfileUse("fprofile-use",
+  llvm::cl::desc("Optimize with a profile merged by llvm-profdata from -fprofile-generate runs"),
+  llvm::cl::value_desc("file.profdata"), llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<std::string> ProfileReport("profile",
+  llvm::cl::desc("Count and time the calls of every definition run at the prompt and print a flat profile on "
+                 "exit, as a table or with -profile=json as JSON"),
+  llvm::cl::value_desc("text|json"), llvm::cl::ValueOptional, llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<bool> PerfJIT("perf",
+  llvm::cl::desc("Describe JIT-compiled functions to perf in /tmp/perf-<pid>.map (and a jitdump if supported)"),
+  llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<bool> GDBJIT("gdb-jit",
+  llvm::cl::desc("Register JIT-compiled functions with GDB and LLDB"),
+  llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<std::string> ServerSocket("server",
+  llvm::cl::desc("Serve compile and eval requests on a Unix socket instead of reading stdin"),
+  llvm::cl::value_desc("path"), llvm::cl::cat(KaleidoscopeCategory));
+
+static llvm::cl::opt<unsigned> ServerThreads("server-threads",
+  llvm::cl::desc("Compile threads of the server (default: hardware threads)"),
+  llvm::cl::init(std::thread::hardware_concurrency()), llvm::cl::cat(KaleidoscopeCategory));
+
+/// GetThreads - The number of threads -j asks for.
+static unsigned GetThreads() {
+  return Jobs ? Jobs : std::thread::hardware_concurrency();
+}
+
+/// CountDefinitions - Number of functions defined in M.
+static unsigned CountDefinitions(llvm::Module &M) {
+  return llvm::count_if(M, [](llvm::Function &F) { return !F.isDeclaration(); });
+}
+
+/// GetProfileOptions - The profile-guided optimization asked for, or an error
+/// if the profile to use cannot be read.
+static llvm::Expected<ProfileOptions> GetProfileOptions() {
+  ProfileOptions Profile;
+  if (ProfileGenerate.getNumOccurrences() && !ProfileUse.empty())
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   "-fprofile-generate and -fprofile-use cannot be combined");
+  if (ProfileGenerate.getNumOccurrences()) {
+    Profile.Mode = ProfileOptions::Generate;
+    Profile.Path = ProfileGenerate.empty() ? "default_%m.profraw" : ProfileGenerate;
+  } else if (!ProfileUse.empty()) {
+    // Check the profile up front; the optimizer would only warn about it.
+    auto Reader = llvm::IndexedInstrProfReader::create(ProfileUse);
+    if (!Reader)
+      return llvm::createStringError(llvm::inconvertibleErrorCode(), ProfileUse + ": " +
+                                     llvm::toString(Reader.takeError()));
+    Profile.Mode = ProfileOptions::Use;
+    Profile.Path = ProfileUse;
+  }
+  if (ProfileReport.getNumOccurrences()) {
+    if (!ProfileReport.empty() && ProfileReport != "text" && ProfileReport != "json")
+      return llvm::createStringError(llvm::inconvertibleErrorCode(), "-profile must be text or json");
+    Profile.Calls = true;
+  }
+  return Profile;
 }
-extern "C" double printd(double X) {
-  printf("%f\n", X);
+
+/// CompileFiles - Compile every input file as a separate unit, then link the
+/// units into Filename, optimizing them together as -lto asks.
+static int CompileFiles(llvm::TargetMachine &TM, const std::string &Filename, const ProfileOptions &Profile) {
+  unsigned Threads = GetThreads();
+  auto Start = std::chrono::steady_clock::now();
+  std::vector<CompiledUnit> Units;
+  for (auto &Path : InputFiles) {
+    auto Buf = llvm::MemoryBuffer::getFileOrSTDIN(Path);
+    if (!Buf) {
+      llvm::errs() << Path << ": " << Buf.getError().message() << "\n";
+      return 1;
+    }
+    auto Unit = CompileUnit(Path, (*Buf)->getBuffer().str(), TM, LTO == LTOThin, Profile, Threads);
+    if (!Unit) {
+      llvm::errs() << llvm::toString(Unit.takeError()) << "\n";
+      return 1;
+    }
+    Units.push_back(std::move(*Unit));
+  }
+  // Report the compile time, to compare thread counts.
+  if (Jobs.getNumOccurrences()) {
+    auto Elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - Start);
+    llvm::errs() << "Compiled " << Units.size() << " units on " << Threads << " threads in " << Elapsed.count()
+                 << " ms\n";
+  }
+
+  if (LTO == LTOThin) {
+    // Every backend makes an object of its own; link them into the output.
+    if (Emit != EmitObject && Emit != EmitShared) {
+      llvm::errs() << "-lto=thin can only -emit=obj or -emit=so\n";
+      return 1;
+    }
+    std::vector<llvm::SmallVector<char, 0>> Objects;
+    if (auto Err = RunThinLTO(Units, TM, Exports, LTOJobs, Objects)) {
+      llvm::errs() << llvm::toString(std::move(Err)) << "\n";
+      return 1;
+    }
+    std::vector<std::string> Paths;
+    auto RemoveObjects = llvm::make_scope_exit([&] {
+      for (auto &Path : Paths)
+        llvm::sys::fs::remove(Path);
+    });
+    uint64_t CodeSize = 0;
+    for (auto &Obj : Objects) {
+      CodeSize += GetCodeSize(Obj);
+      llvm::SmallString<128> Path;
+      int FD;
+      if (auto EC = llvm::sys::fs::createTemporaryFile("kaleidoscope", "o", FD, Path)) {
+        llvm::errs() << "Could not create a temporary file: " << EC.message() << "\n";
+        return 1;
+      }
+      Paths.push_back(Path.str().str());
+      llvm::raw_fd_ostream(FD, /*shouldClose=*/true) << llvm::StringRef(Obj.data(), Obj.size());
+    }
+    if (auto Err = LinkObjects(Paths, Filename, Emit == EmitShared)) {
+      llvm::errs() << llvm::toString(std::move(Err)) << "\n";
+      return 1;
+    }
+    ReportMemory("emission");
+    llvm::errs() << "ThinLTO: " << Units.size() << " units, " << Objects.size() << " objects, code size "
+                 << CodeSize << " bytes\n";
+    llvm::outs() << "Wrote " << Filename << "\n";
+    return 0;
+  }
+
+  llvm::LLVMContext Context;
+  auto M = LinkUnits(Units, Context);
+  if (!M) {
+    llvm::errs() << llvm::toString(M.takeError()) << "\n";
+    return 1;
+  }
+  if (LTO == LTOFull) {
+    unsigned Before = CountDefinitions(**M);
+    RunFullLTO(**M, TM, Exports);
+    llvm::errs() << "Full LTO: " << Before << " functions before, " << CountDefinitions(**M) << " after\n";
+  }
+
+  Start = std::chrono::steady_clock::now();
+  if (Emit == EmitObject) {
+    // Report the code size, to compare the -lto modes.
+    llvm::SmallVector<char, 0> Obj;
+    if (auto Err = EmitToBuffer(**M, TM, EmitObject, Obj, Threads)) {
+      llvm::errs() << llvm::toString(std::move(Err)) << "\n";
+      return 1;
+    }
+    std::error_code EC;
+    llvm::raw_fd_ostream dest(Filename, EC, llvm::sys::fs::OF_None);
+    if (EC) {
+      llvm::errs() << "Could not open file: " << EC.message() << "\n";
+      return 1;
+    }
+    dest << llvm::StringRef(Obj.data(), Obj.size());
+    llvm::errs() << "Code size: " << GetCodeSize(Obj) << " bytes\n";
+  } else if (auto Err = EmitToFile(**M, TM, Emit, Filename, Threads)) {
+    llvm::errs() << llvm::toString(std::move(Err)) << "\n";
+    return 1;
+  }
+  ReportMemory("emission");
+  if (Jobs.getNumOccurrences()) {
+    auto Elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - Start);
+    llvm::errs() << "Emitted " << Filename << " on " << Threads << " threads in " << Elapsed.count() << " ms\n";
+  }
+  llvm::outs() << "Wrote " << Filename << "\n";
   return 0;
 }
 
-int main() {
-   // Initialize the target registry etc.
+int main(int argc, char **argv) {
+  llvm::cl::HideUnrelatedOptions(KaleidoscopeCategory);
+  llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope compiler\n");
+  EnableMemoryStats(MemStats);
+  EnableSubexpressionSharing(ShareSubexpressions);
+
+  // Initialize the target registry etc.
   llvm::InitializeAllTargetInfos();
   llvm::InitializeAllTargets();
   llvm::InitializeAllTargetMCs();
@@ -40,27 +294,72 @@ int main() {
     return 1;
   }
 
-  auto CPU = "generic";
-  auto Features = "";
+  // The target features decide, among other things, the width of vec().
+  std::string CPU = MCPU;
+  std::string Features = MAttrs;
+  if (CPU == "native") {
+    CPU = llvm::sys::getHostCPUName().str();
+    llvm::StringMap<bool> HostFeatures;
+    if (llvm::sys::getHostCPUFeatures(HostFeatures))
+      for (auto &F : HostFeatures)
+        Features += (Features.empty() ? "" : ",") + std::string(F.second ? "+" : "-") + F.first().str();
+  }
+
+  JITListeners Listeners;
+  Listeners.Perf = PerfJIT;
+  Listeners.GDB = GDBJIT;
+
+  if (!ServerSocket.empty()) {
+    llvm::orc::JITTargetMachineBuilder JTMB((llvm::Triple(TargetTriple)));
+    JTMB.setCPU(CPU);
+    JTMB.addFeatures(llvm::SubtargetFeatures(Features).getFeatures());
+    JTMB.setRelocationModel(llvm::Reloc::PIC_);
+    return RunServer(ServerSocket, std::move(JTMB), ServerThreads, Listeners);
+  }
 
   llvm::TargetOptions opt;
   auto TheTargetMachine = Target->createTargetMachine(TargetTriple, CPU, Features, opt, llvm::Reloc::PIC_);
 
+  std::string Filename = OutputFilename.empty() ? std::string("output.") + GetEmitExtension(Emit)
+                                                : std::string(OutputFilename);
+  auto Profile = GetProfileOptions();
+  if (!Profile) {
+    llvm::errs() << llvm::toString(Profile.takeError()) << "\n";
+    return 1;
+  }
+  if (!InputFiles.empty())
+    return CompileFiles(*TheTargetMachine, Filename, *Profile);
+  if (LTO != LTONone) {
+    llvm::errs() << "-lto needs input files\n";
+    return 1;
+  }
+
+  // Top-level expressions read from stdin are run right away.
+  auto JIT = KaleidoscopeJIT::Create(Listeners);
+  if (!JIT) {
+    llvm::errs() << llvm::toString(JIT.takeError()) << "\n";
+    return 1;
+  }
+
   auto interpreter = std::make_unique<Interpreter>(
     std::move(std::make_unique<Parser>(std::move(std::make_unique<Lexer>()))),  // Parser
-    std::move(std::make_unique<LLVMCodegen>()), // Codegen
-    TheTargetMachine->createDataLayout(),
-    TargetTriple
+    std::move(std::make_unique<LLVMCodegen>(/*DebugLogging=*/true, *Profile)), // Codegen
+    TheTargetMachine
   );
+  if (auto Err = interpreter->EnableEvaluation(**JIT)) {
+    llvm::errs() << llvm::toString(std::move(Err)) << "\n";
+    return 1;
+  }
   auto parser = interpreter->GetParser();
 
   // Install standard binary operators.
-  // 1 is lowest precedence.
-  parser->AddBinop('=', 2);
-  parser->AddBinop('<', 10);
-  parser->AddBinop('+', 20);
-  parser->AddBinop('-', 30);
-  parser->AddBinop('*', 40);
+  parser->AddStandardBinops();
+
+  if (!LoadSnapshotFile.empty())
+    if (auto Err = interpreter->LoadSnapshot(LoadSnapshotFile)) {
+      llvm::errs() << llvm::toString(std::move(Err)) << "\n";
+      return 1;
+    }
 
   // Prime the first token.
   fprintf(stderr, "ready> ");
@@ -68,27 +367,25 @@ int main() {
 
   // Run the main "interpreter loop" now.
   interpreter->MainLoop();
+  ReportMemory("parsing and IR generation");
+  if (Profile->Calls)
+    ks_profile_report(ProfileReport == "json");
+  if (ReplStats)
+    interpreter->PrintStats();
+  if (!SaveSnapshotFile.empty())
+    if (auto Err = interpreter->SaveSnapshot(SaveSnapshotFile)) {
+      llvm::errs() << llvm::toString(std::move(Err)) << "\n";
+      return 1;
+    }
+  interpreter->GetCodegen()->OptimizeModule();
+  ReportMemory("optimization");
 
   auto TheModule = std::move(interpreter->GetCodegen()->getModule());
-  auto Filename = "output.o";
-  std::error_code EC;
-  llvm::raw_fd_ostream dest(Filename, EC, llvm::sys::fs::OF_None);
-
-  if (EC) {
-    llvm::errs() << "Could not open file: " << EC.message();
-    return 1;
-  }
-
-  llvm::legacy::PassManager pass;
-  auto FileType = llvm::CodeGenFileType::CGFT_ObjectFile;
-
-  if (TheTargetMachine->addPassesToEmitFile(pass, dest, nullptr, FileType)) {
-    llvm::errs() << "TheTargetMachine can't emit a file of this type";
+  if (auto Err = EmitToFile(*TheModule, *TheTargetMachine, Emit, Filename, GetThreads())) {
+    llvm::errs() << llvm::toString(std::move(Err)) << "\n";
     return 1;
   }
-
-  pass.run(*TheModule);
-  dest.flush();
+  ReportMemory("emission");
 
   llvm::outs() << "Wrote " << Filename << "\n";
   return 0;
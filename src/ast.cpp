@@ -1,3 +1,5 @@
+#include <cstring>
+
 #include <llvm/IR/Value.h>
 
 #include "ast.h"
@@ -15,12 +17,16 @@ llvm::Value* VariableExprAST::accept(Codegen& visitor) { return visitor.VisitVar
 char BinaryExprAST::GetOp() { return Op; }
 ExprAST *BinaryExprAST::GetLHS() { return LHS.get(); }
 ExprAST *BinaryExprAST::GetRHS() { return RHS.get(); }
-llvm::Value* BinaryExprAST::accept(Codegen& visitor) { return visitor.VisitBinaryExpr(this); }
+llvm::Value* BinaryExprAST::accept(Codegen& visitor) {
+  return IsShared() ? visitor.VisitShared(this) : visitor.VisitBinaryExpr(this);
+}
 
 // CallExprAST
 std::string &CallExprAST::GetCallee() { return Callee; }
 std::vector<std::unique_ptr<ExprAST>> &CallExprAST::GetArgs() { return Args; }
-llvm::Value* CallExprAST::accept(Codegen& visitor) { return visitor.VisitCall(this); }
+llvm::Value* CallExprAST::accept(Codegen& visitor) {
+  return IsShared() ? visitor.VisitShared(this) : visitor.VisitCall(this);
+}
 
 // PrototypeAST
 std::string &PrototypeAST::GetName() { return Name; };
@@ -28,7 +34,7 @@ std::vector<std::string> &PrototypeAST::GetArgs() { return Args; };
 llvm::Function* PrototypeAST::accept(Codegen& visitor) { return visitor.VisitPrototype(this); }
 
 // FunctionAST
-std::unique_ptr<PrototypeAST> FunctionAST::GetProto() { return std::move(Proto); }
+PrototypeAST *FunctionAST::GetProto() { return Proto.get(); }
 ExprAST *FunctionAST::GetBody() { return Body.get(); }
 llvm::Function* FunctionAST::accept(Codegen& visitor) { return visitor.VisitFunction(this); }
 
@@ -39,7 +45,82 @@ llvm::Value* IfExprAST::accept(Codegen& visitor) { return visitor.VisitIf(this);
 llvm::Value* ForExprAST::accept(Codegen& visitor) { return visitor.VisitFor(this); }
 
 // UnaryExprAST
-llvm::Value* UnaryExprAST::accept(Codegen& visitor) { return visitor.VisitUnary(this); }
+llvm::Value* UnaryExprAST::accept(Codegen& visitor) {
+  return IsShared() ? visitor.VisitShared(this) : visitor.VisitUnary(this);
+}
 
 // VarExprAST
-llvm::Value* VarExprAST::accept(Codegen& visitor) { return visitor.VisitVar(this); }
\ No newline at end of file
+llvm::Value* VarExprAST::accept(Codegen& visitor) { return visitor.VisitVar(this); }
+
+// IndexExprAST
+llvm::Value* IndexExprAST::accept(Codegen& visitor) {
+  return IsShared() ? visitor.VisitShared(this) : visitor.VisitIndex(this);
+}
+
+// VectorExprAST
+llvm::Value* VectorExprAST::accept(Codegen& visitor) { return visitor.VisitVector(this); }
+
+// RefExprAST
+llvm::Value* RefExprAST::accept(Codegen& visitor) { return visitor.VisitShared(Target); }
+
+void CollectCallees(ExprAST *E, std::set<std::string> &Callees) {
+  if (!E)
+    return;
+  switch (E->GetKind()) {
+  case ExprAST::EK_Number:
+  case ExprAST::EK_Variable:
+    break;
+  case ExprAST::EK_Binary: {
+    auto *B = static_cast<BinaryExprAST *>(E);
+    if (!strchr("=<+-*", B->GetOp()))
+      Callees.insert(std::string("binary") + B->GetOp());
+    CollectCallees(B->GetLHS(), Callees);
+    CollectCallees(B->GetRHS(), Callees);
+    break;
+  }
+  case ExprAST::EK_Call: {
+    auto *C = static_cast<CallExprAST *>(E);
+    Callees.insert(C->GetCallee());
+    for (auto &Arg : C->GetArgs())
+      CollectCallees(Arg.get(), Callees);
+    break;
+  }
+  case ExprAST::EK_If: {
+    auto *I = static_cast<IfExprAST *>(E);
+    CollectCallees(I->GetCond(), Callees);
+    CollectCallees(I->GetThen(), Callees);
+    CollectCallees(I->GetElse(), Callees);
+    break;
+  }
+  case ExprAST::EK_For: {
+    auto *F = static_cast<ForExprAST *>(E);
+    CollectCallees(F->GetStart(), Callees);
+    CollectCallees(F->GetEnd(), Callees);
+    CollectCallees(F->GetStep(), Callees);
+    CollectCallees(F->GetBody(), Callees);
+    break;
+  }
+  case ExprAST::EK_Unary: {
+    auto *U = static_cast<UnaryExprAST *>(E);
+    Callees.insert(std::string("unary") + U->GetOpcode());
+    CollectCallees(U->GetOperand(), Callees);
+    break;
+  }
+  case ExprAST::EK_Var: {
+    auto *V = static_cast<VarExprAST *>(E);
+    for (auto &[Name, Init] : *V->GetVarNames())
+      CollectCallees(Init.get(), Callees);
+    CollectCallees(V->GetBody(), Callees);
+    break;
+  }
+  case ExprAST::EK_Index:
+    CollectCallees(static_cast<IndexExprAST *>(E)->GetIndex(), Callees);
+    break;
+  case ExprAST::EK_Vector:
+    for (auto &Element : static_cast<VectorExprAST *>(E)->GetElements())
+      CollectCallees(Element.get(), Callees);
+    break;
+  case ExprAST::EK_Ref: // the first occurrence has been seen
+    break;
+  }
+}
\ No newline at end of file
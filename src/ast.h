@@ -1,6 +1,7 @@
 #ifndef AST_H
 #define AST_H
 
+#include <set>
 #include <string>
 #include <vector>
 
@@ -11,8 +12,38 @@ class Codegen;
 /// ExprAST - Base class for all expression nodes.
 class ExprAST {
 public:
+  /// ExprKind - Discriminator for the concrete node type, since LLVM (and so
+  /// this project) is usually built without RTTI.
+  enum ExprKind : uint8_t {
+    EK_Number,
+    EK_Variable,
+    EK_Binary,
+    EK_Call,
+    EK_If,
+    EK_For,
+    EK_Unary,
+    EK_Var,
+    EK_Index,
+    EK_Vector,
+    EK_Ref,
+  };
+
+  ExprAST(ExprKind Kind) : Kind(Kind) {}
   virtual ~ExprAST() = default;
   virtual llvm::Value* accept(Codegen& visitor) = 0;
+  ExprKind GetKind() const { return Kind; }
+  /// IsShared - Whether RefExprAST nodes refer to this expression.
+  bool IsShared() const { return Shared; }
+  void SetShared() { Shared = true; }
+  /// GetHash - The structural hash the parser gave an expression it may
+  /// share, or 0; see Parser::Intern.
+  uint32_t GetHash() const { return Hash; }
+  void SetHash(uint32_t H) { Hash = H; }
+
+private:
+  const ExprKind Kind;
+  bool Shared = false;
+  uint32_t Hash = 0;
 };
 
 /// NumberExprAST - Expression class for numeric literals like "1.0".
@@ -20,7 +51,7 @@ class NumberExprAST: public ExprAST {
   double Val;
 
 public:
-  NumberExprAST(double Val): Val(Val) {}
+  NumberExprAST(double Val): ExprAST(EK_Number), Val(Val) {}
   llvm::Value* accept(Codegen& visitor);
   double GetVal();
 };
@@ -30,7 +61,7 @@ class VariableExprAST : public ExprAST {
   std::string Name;
 
 public:
-  VariableExprAST(const std::string &Name) : Name(Name) {}
+  VariableExprAST(const std::string &Name) : ExprAST(EK_Variable), Name(Name) {}
   llvm::Value* accept(Codegen& visitor);
   std::string &GetName();
 };
@@ -43,7 +74,7 @@ class BinaryExprAST : public ExprAST {
 public:
   BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
                 std::unique_ptr<ExprAST> RHS)
-    : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+    : ExprAST(EK_Binary), Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
   llvm::Value* accept(Codegen& visitor);
 
   char GetOp();
@@ -59,28 +90,81 @@ class CallExprAST : public ExprAST {
 public:
   CallExprAST(const std::string &Callee,
               std::vector<std::unique_ptr<ExprAST>> Args)
-    : Callee(Callee), Args(std::move(Args)) {}
+    : ExprAST(EK_Call), Callee(Callee), Args(std::move(Args)) {}
   llvm::Value* accept(Codegen& visitor);
   std::string &GetCallee();
   std::vector<std::unique_ptr<ExprAST>> &GetArgs();
 };
 
+/// IndexExprAST - Expression class for indexing an array argument, like
+/// "a[i]".
+class IndexExprAST : public ExprAST {
+  std::string Name;
+  std::unique_ptr<ExprAST> Index;
+
+public:
+  IndexExprAST(const std::string &Name, std::unique_ptr<ExprAST> Index)
+    : ExprAST(EK_Index), Name(Name), Index(std::move(Index)) {}
+  llvm::Value* accept(Codegen& visitor);
+
+  std::string &GetName() { return Name; }
+  ExprAST *GetIndex() { return Index.get(); }
+};
+
+/// VectorExprAST - Expression class for vector constructors, like
+/// "vec4(a, b, c, d)", or broadcasts like "vec4(x)".  A width of 0 means the
+/// native vector width of the target.
+class VectorExprAST : public ExprAST {
+  unsigned Width;
+  std::vector<std::unique_ptr<ExprAST>> Elements;
+
+public:
+  VectorExprAST(unsigned Width, std::vector<std::unique_ptr<ExprAST>> Elements)
+    : ExprAST(EK_Vector), Width(Width), Elements(std::move(Elements)) {}
+  llvm::Value* accept(Codegen& visitor);
+
+  unsigned GetWidth() { return Width; }
+  std::vector<std::unique_ptr<ExprAST>> &GetElements() { return Elements; }
+};
+
+/// RefExprAST - Another occurrence of an expression parsed earlier in the same
+/// definition.  The parser shares identical binary, unary, call and index
+/// expressions this way, so a body is a DAG; the target is owned by its first
+/// occurrence.
+class RefExprAST : public ExprAST {
+  ExprAST *Target;
+
+public:
+  RefExprAST(ExprAST *Target) : ExprAST(EK_Ref), Target(Target) {}
+  llvm::Value* accept(Codegen& visitor);
+
+  ExprAST *GetTarget() { return Target; }
+};
+
+/// CollectCallees - Add the functions and user-defined operators (as
+/// "binaryX"/"unaryX") E calls to Callees.
+void CollectCallees(ExprAST *E, std::set<std::string> &Callees);
+
 /// PrototypeAST - This class represents the "prototype" for a function,
 /// which captures its name, and its argument names (thus implicitly the number
-/// of arguments the function takes).
+/// of arguments the function takes).  Arguments declared as "a[]" are arrays,
+/// passed as a pointer and a length.
 class PrototypeAST {
   std::string Name;
   std::vector<std::string> Args;
+  std::vector<bool> ArrayArgs;
   bool _isOperator;
   unsigned Precedence;  // Precedence if a binary op.
 
 public:
-  PrototypeAST(const std::string &Name, std::vector<std::string> Args, bool isOperator, unsigned precedence)
-    : Name(Name), Args(std::move(Args)), _isOperator(isOperator), Precedence(precedence) {}
+  PrototypeAST(const std::string &Name, std::vector<std::string> Args, bool isOperator, unsigned precedence,
+               std::vector<bool> ArrayArgs = {})
+    : Name(Name), Args(std::move(Args)), ArrayArgs(std::move(ArrayArgs)), _isOperator(isOperator), Precedence(precedence) {}
 
   llvm::Function* accept(Codegen& visitor);
   std::string &GetName();
   std::vector<std::string> &GetArgs();
+  bool IsArrayArg(unsigned i) const { return i < ArrayArgs.size() && ArrayArgs[i]; }
   
   bool IsUnaryOp() const { return _isOperator && Args.size() == 1; }
   bool IsBinaryOp() const { return _isOperator && Args.size() == 2; }
@@ -98,15 +182,17 @@ public:
 class FunctionAST {
   std::unique_ptr<PrototypeAST> Proto;
   std::unique_ptr<ExprAST> Body;
+  bool Memo;  // Cache results keyed by the argument values.
 
 public:
   FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-              std::unique_ptr<ExprAST> Body)
-    : Proto(std::move(Proto)), Body(std::move(Body)) {}
+              std::unique_ptr<ExprAST> Body, bool Memo = false)
+    : Proto(std::move(Proto)), Body(std::move(Body)), Memo(Memo) {}
   llvm::Function* accept(Codegen& visitor);
 
-  std::unique_ptr<PrototypeAST> GetProto();
+  PrototypeAST *GetProto();
   ExprAST *GetBody();
+  bool IsMemo() const { return Memo; }
 };
 
 /// IfExprAST - Expression class for if/then/else.
@@ -116,33 +202,39 @@ class IfExprAST : public ExprAST {
 public:
   IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
             std::unique_ptr<ExprAST> Else)
-    : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+    : ExprAST(EK_If), Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
   llvm::Value* accept(Codegen& visitor);
 
-  std::unique_ptr<ExprAST> GetCond() { return std::move(Cond); }
-  std::unique_ptr<ExprAST> GetThen() { return std::move(Then); }
-  std::unique_ptr<ExprAST> GetElse() { return std::move(Else); }
+  ExprAST *GetCond() { return Cond.get(); }
+  ExprAST *GetThen() { return Then.get(); }
+  ExprAST *GetElse() { return Else.get(); }
 
 };
 
-/// ForExprAST - Expression class for for/in.
+/// ForExprAST - Expression class for for/in and parfor/in.  For a parallel
+/// loop End is an exclusive bound rather than a condition, and ReduceOp is the
+/// operator ('+' or '*') combining the body values, or 0.
 class ForExprAST : public ExprAST {
   std::string VarName;
   std::unique_ptr<ExprAST> Start, End, Step, Body;
+  bool Parallel;
+  char ReduceOp;
 
 public:
   ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
              std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
-             std::unique_ptr<ExprAST> Body)
-    : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-      Step(std::move(Step)), Body(std::move(Body)) {}
+             std::unique_ptr<ExprAST> Body, bool Parallel = false, char ReduceOp = 0)
+    : ExprAST(EK_For), VarName(VarName), Start(std::move(Start)), End(std::move(End)),
+      Step(std::move(Step)), Body(std::move(Body)), Parallel(Parallel), ReduceOp(ReduceOp) {}
   llvm::Value* accept(Codegen& visitor);
 
   std::string& GetVarName() { return VarName; }
-  std::unique_ptr<ExprAST> GetStart() { return std::move(Start); }
-  std::unique_ptr<ExprAST> GetEnd() { return std::move(End); }
-  std::unique_ptr<ExprAST> GetStep() { return std::move(Step); }
-  std::unique_ptr<ExprAST> GetBody() { return std::move(Body); }
+  bool IsParallel() const { return Parallel; }
+  char GetReduceOp() const { return ReduceOp; }
+  ExprAST *GetStart() { return Start.get(); }
+  ExprAST *GetEnd() { return End.get(); }
+  ExprAST *GetStep() { return Step.get(); }
+  ExprAST *GetBody() { return Body.get(); }
 
 };
 
@@ -153,11 +245,11 @@ class UnaryExprAST : public ExprAST {
 
 public:
   UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
-    : Opcode(Opcode), Operand(std::move(Operand)) {}
+    : ExprAST(EK_Unary), Opcode(Opcode), Operand(std::move(Operand)) {}
 
   llvm::Value *accept(Codegen& visitor) override;
   char GetOpcode() { return Opcode; }
-  std::unique_ptr<ExprAST> GetOperand() { return std::move(Operand); }
+  ExprAST *GetOperand() { return Operand.get(); }
 };
 
 /// VarExprAST - Expression class for var/in
@@ -168,11 +260,11 @@ class VarExprAST : public ExprAST {
 public:
   VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
              std::unique_ptr<ExprAST> Body)
-    : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
+    : ExprAST(EK_Var), VarNames(std::move(VarNames)), Body(std::move(Body)) {}
 
   llvm::Value *accept(Codegen& visitor);
   std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>>* GetVarNames() { return &VarNames; }
-  std::unique_ptr<ExprAST> GetBody() { return std::move(Body); }
+  ExprAST *GetBody() { return Body.get(); }
 };
 
 #endif
\ No newline at end of file
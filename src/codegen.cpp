@@ -1,39 +1,311 @@
+#include <algorithm>
+#include <cmath>
+#include <optional>
+
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/InstIterator.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/ProfileData/InstrProf.h>
 #include <llvm/Support/Error.h>
+#include <llvm/Transforms/Instrumentation.h>
+#include <llvm/Transforms/Instrumentation/InstrProfiling.h>
+#include <llvm/Transforms/Instrumentation/PGOInstrumentation.h>
 #include <llvm/Transforms/Utils.h>
 #include <llvm/Transforms/Utils/Mem2Reg.h>
 #include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Scalar/LICM.h>
+#include <llvm/Transforms/Scalar/LoopPassManager.h>
+#include <llvm/Transforms/Scalar/TailRecursionElimination.h>
+#include <llvm/Transforms/Scalar/IndVarSimplify.h>
+#include <llvm/Transforms/Vectorize/LoopVectorize.h>
+#include <llvm/Transforms/Vectorize/SLPVectorizer.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 
 #include "codegen.h"
 #include "errors.h"
+#include "funcattrs.h"
 #include "ast.h"
 
 /// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
-/// the function.  This is used for mutable variables etc.
-llvm::AllocaInst *LLVMCodegen::CreateEntryBlockAlloca(llvm::Function *TheFunction, const std::string &VarName) {
+/// the function.  This is used for mutable variables etc.  Variables are
+/// doubles unless another type, such as a vector, is given.
+llvm::AllocaInst *LLVMCodegen::CreateEntryBlockAlloca(llvm::Function *TheFunction, const std::string &VarName,
+                                                      llvm::Type *Ty) {
   llvm::IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
-  return TmpB.CreateAlloca(llvm::Type::getDoubleTy(*TheContext), nullptr, VarName);
+  return TmpB.CreateAlloca(Ty ? Ty : llvm::Type::getDoubleTy(*TheContext), nullptr, VarName);
+}
+
+/// TailCallBefore - Return V if it is a call that immediately precedes Term and
+/// can be made a musttail call from F, or null otherwise.
+static llvm::CallInst *TailCallBefore(llvm::Function &F, llvm::Value *V, llvm::Instruction *Term) {
+  auto *CI = llvm::dyn_cast_or_null<llvm::CallInst>(V);
+  if (!CI || CI->getNextNode() != Term)
+    return nullptr;
+
+  // musttail requires the caller and callee prototypes to match exactly.
+  llvm::Function *Callee = CI->getCalledFunction();
+  if (!Callee || Callee->isIntrinsic() || Callee->getFunctionType() != F.getFunctionType() ||
+      Callee->getCallingConv() != F.getCallingConv())
+    return nullptr;
+  return CI;
 }
 
-void LLVMCodegen::NewModule(const llvm::DataLayout &layout, const llvm::StringRef &triple) {
-  // Open a new context and module.
-  TheContext = std::make_unique<llvm::LLVMContext>();
+/// MarkMustTailCalls - Guarantee that calls in tail position to functions with
+/// the same prototype, as in mutually recursive definitions, run in constant
+/// stack space.  The return of an if/then/else merge block is first duplicated
+/// into the branches that end in such a call.
+static void MarkMustTailCalls(llvm::Function &F) {
+  llvm::SmallVector<std::pair<llvm::ReturnInst *, llvm::BasicBlock *>, 4> Folds;
+  for (auto &BB : F) {
+    auto *Ret = llvm::dyn_cast<llvm::ReturnInst>(BB.getTerminator());
+    if (!Ret)
+      continue;
+    auto *PN = llvm::dyn_cast_or_null<llvm::PHINode>(Ret->getReturnValue());
+    if (!PN || PN->getParent() != &BB || BB.getFirstNonPHI() != Ret)
+      continue;
+    for (auto *Pred : llvm::predecessors(&BB)) {
+      auto *Br = llvm::dyn_cast<llvm::BranchInst>(Pred->getTerminator());
+      if (Br && Br->isUnconditional() && TailCallBefore(F, PN->getIncomingValueForBlock(Pred), Br))
+        Folds.push_back({Ret, Pred});
+    }
+  }
+  for (auto &[Ret, Pred] : Folds)
+    llvm::FoldReturnIntoUncondBranch(Ret, Ret->getParent(), Pred);
+
+  for (auto &BB : F) {
+    auto *Ret = llvm::dyn_cast<llvm::ReturnInst>(BB.getTerminator());
+    if (!Ret)
+      continue;
+    if (auto *CI = TailCallBefore(F, Ret->getReturnValue(), Ret))
+      CI->setTailCallKind(llvm::CallInst::TCK_MustTail);
+  }
+}
+
+/// MemoCacheBits - log2 of the number of entries in the result cache of a
+/// 'memo' function.
+static const unsigned MemoCacheBits = 12;
+
+// Wrap a pure function in a direct-mapped result cache keyed by the bit
+// patterns of its arguments.  Every entry is guarded by a sequence number,
+// odd while the entry is being written, so that concurrent callers never see
+// the keys of one result with the value of another:
+//   memo.lookup:
+//     bits = bitcast args to i64
+//     hash = fold (hash ^ bits) * 0x9E3779B97F4A7C15 over bits
+//     entry = &cache[hash >> (64 - MemoCacheBits)]
+//     seq = load acquire entry.seq
+//     tag, keys, value = load entry
+//     fence acquire
+//     br seq is even && seq == entry.seq &&
+//        tag == (hash | 1) && keys == bits, memo.hit, entry
+//   memo.hit:
+//     ret value
+//   entry:
+//     ...original body, with every 'ret v' replaced by 'br memo.store'
+//   memo.store:
+//     if entry.seq is even and cmpxchg entry.seq, seq, seq + 1 succeeds:
+//       fence release
+//       store { hash | 1, bits, v } -> entry
+//       store release seq + 2 -> entry.seq
+//     ret v
+//
+// Each function gets its own zero-initialized table of 2^MemoCacheBits
+// entries.  A new result evicts whatever was stored in its slot before, so
+// memory use stays bounded.  A result is not stored if another thread is
+// writing the slot at the same time, and a slot being written is a miss.
+void LLVMCodegen::EmitMemoCache(llvm::Function *TheFunction) {
+  llvm::Type *I64 = llvm::Type::getInt64Ty(*TheContext);
+  llvm::Type *DoubleTy = llvm::Type::getDoubleTy(*TheContext);
+  llvm::Type *KeysTy = llvm::ArrayType::get(I64, TheFunction->arg_size());
+  // The value is kept as its bit pattern, like the keys.
+  llvm::StructType *EntryTy = llvm::StructType::get(*TheContext, {I64, I64, KeysTy, I64});
+  llvm::ArrayType *CacheTy = llvm::ArrayType::get(EntryTy, 1u << MemoCacheBits);
+  auto *Cache = new llvm::GlobalVariable(*TheModule, CacheTy, false, llvm::GlobalValue::InternalLinkage,
+                                         llvm::ConstantAggregateZero::get(CacheTy), TheFunction->getName() + ".memo");
+  Cache->setAlignment(llvm::Align(64));
+
+  llvm::BasicBlock *BodyBB = &TheFunction->getEntryBlock();
+  llvm::BasicBlock *LookupBB = llvm::BasicBlock::Create(*TheContext, "memo.lookup", TheFunction, BodyBB);
+  llvm::BasicBlock *HitBB = llvm::BasicBlock::Create(*TheContext, "memo.hit", TheFunction, BodyBB);
+
+  // Every field is accessed atomically; plain accesses racing with a writer
+  // would be undefined behaviour even when the sequence number rejects them.
+  auto Load = [](llvm::IRBuilder<> &B, llvm::Value *Ptr, llvm::AtomicOrdering Order, const llvm::Twine &Name) {
+    llvm::LoadInst *L = B.CreateAlignedLoad(B.getInt64Ty(), Ptr, llvm::Align(8), Name);
+    L->setAtomic(Order);
+    return L;
+  };
+  auto Store = [](llvm::IRBuilder<> &B, llvm::Value *V, llvm::Value *Ptr, llvm::AtomicOrdering Order) {
+    B.CreateAlignedStore(V, Ptr, llvm::Align(8))->setAtomic(Order);
+  };
+
+  // Hash the arguments and probe their slot.
+  llvm::IRBuilder<> TmpB(LookupBB);
+  std::vector<llvm::Value *> Keys;
+  llvm::Value *Hash = TmpB.getInt64(0);
+  for (auto &Arg : TheFunction->args()) {
+    Keys.push_back(TmpB.CreateBitOrPointerCast(&Arg, I64, "memo.key"));
+    Hash = TmpB.CreateMul(TmpB.CreateXor(Hash, Keys.back()), TmpB.getInt64(0x9E3779B97F4A7C15ULL), "memo.hash");
+  }
+  llvm::Value *Tag = TmpB.CreateOr(Hash, 1, "memo.tag");
+  llvm::Value *Slot = TmpB.CreateLShr(Hash, 64 - MemoCacheBits, "memo.slot");
+  llvm::Value *Entry = TmpB.CreateInBoundsGEP(CacheTy, Cache, {TmpB.getInt64(0), Slot}, "memo.entry");
+  llvm::Value *SeqPtr = TmpB.CreateStructGEP(EntryTy, Entry, 0);
+  llvm::Value *TagPtr = TmpB.CreateStructGEP(EntryTy, Entry, 1);
+  llvm::Value *ValuePtr = TmpB.CreateStructGEP(EntryTy, Entry, 3);
+  std::vector<llvm::Value *> KeyPtrs;
+  for (unsigned i = 0, e = Keys.size(); i != e; ++i)
+    KeyPtrs.push_back(TmpB.CreateInBoundsGEP(EntryTy, Entry, {TmpB.getInt64(0), TmpB.getInt32(2), TmpB.getInt32(i)}));
+
+  auto Relaxed = llvm::AtomicOrdering::Monotonic;
+  llvm::Value *Seq = Load(TmpB, SeqPtr, llvm::AtomicOrdering::Acquire, "memo.seq");
+  llvm::Value *Hit = TmpB.CreateICmpEQ(Load(TmpB, TagPtr, Relaxed, "memo.tagv"), Tag);
+  for (unsigned i = 0, e = Keys.size(); i != e; ++i)
+    Hit = TmpB.CreateAnd(Hit, TmpB.CreateICmpEQ(Load(TmpB, KeyPtrs[i], Relaxed, "memo.keyv"), Keys[i]));
+  llvm::Value *Value = Load(TmpB, ValuePtr, Relaxed, "memo.bits");
+  TmpB.CreateFence(llvm::AtomicOrdering::Acquire);
+  Hit = TmpB.CreateAnd(Hit, TmpB.CreateICmpEQ(Load(TmpB, SeqPtr, Relaxed, "memo.seq2"), Seq));
+  Hit = TmpB.CreateAnd(Hit, TmpB.CreateICmpEQ(TmpB.CreateAnd(Seq, 1), TmpB.getInt64(0)));
+  TmpB.CreateCondBr(Hit, HitBB, BodyBB);
+
+  TmpB.SetInsertPoint(HitBB);
+  TmpB.CreateRet(TmpB.CreateBitCast(Value, DoubleTy, "memo.value"));
+
+  // Route every freshly computed result through one block that records it.
+  llvm::BasicBlock *StoreBB = llvm::BasicBlock::Create(*TheContext, "memo.store", TheFunction);
+  llvm::BasicBlock *LockBB = llvm::BasicBlock::Create(*TheContext, "memo.lock", TheFunction);
+  llvm::BasicBlock *WriteBB = llvm::BasicBlock::Create(*TheContext, "memo.write", TheFunction);
+  llvm::BasicBlock *RetBB = llvm::BasicBlock::Create(*TheContext, "memo.ret", TheFunction);
+  TmpB.SetInsertPoint(StoreBB);
+  llvm::PHINode *Result = TmpB.CreatePHI(DoubleTy, 2, "memo.result");
+  for (auto &BB : *TheFunction) {
+    auto *Ret = llvm::dyn_cast_or_null<llvm::ReturnInst>(BB.getTerminator());
+    if (!Ret || &BB == HitBB)
+      continue;
+    Result->addIncoming(Ret->getReturnValue(), &BB);
+    llvm::BranchInst::Create(StoreBB, Ret);
+    Ret->eraseFromParent();
+  }
+
+  // Take the slot by making its sequence number odd, unless another thread
+  // holds it, then publish the entry with the next even number.
+  llvm::Value *Current = Load(TmpB, SeqPtr, Relaxed, "memo.cur");
+  TmpB.CreateCondBr(TmpB.CreateICmpEQ(TmpB.CreateAnd(Current, 1), TmpB.getInt64(0)), LockBB, RetBB);
+  TmpB.SetInsertPoint(LockBB);
+  auto *Locked = TmpB.CreateAtomicCmpXchg(SeqPtr, Current, TmpB.CreateAdd(Current, TmpB.getInt64(1)),
+                                          llvm::MaybeAlign(8), Relaxed, Relaxed);
+  TmpB.CreateCondBr(TmpB.CreateExtractValue(Locked, 1), WriteBB, RetBB);
+  TmpB.SetInsertPoint(WriteBB);
+  TmpB.CreateFence(llvm::AtomicOrdering::Release);
+  Store(TmpB, Tag, TagPtr, Relaxed);
+  for (unsigned i = 0, e = Keys.size(); i != e; ++i)
+    Store(TmpB, Keys[i], KeyPtrs[i], Relaxed);
+  Store(TmpB, TmpB.CreateBitCast(Result, I64), ValuePtr, Relaxed);
+  Store(TmpB, TmpB.CreateAdd(Current, TmpB.getInt64(2)), SeqPtr, llvm::AtomicOrdering::Release);
+  TmpB.CreateBr(RetBB);
+  TmpB.SetInsertPoint(RetBB);
+  TmpB.CreateRet(Result);
+
+  // The function is no longer free of side effects.
+  TheFunction->removeFnAttr(llvm::Attribute::Memory);
+  TheFunction->removeFnAttr(llvm::Attribute::Speculatable);
+}
+
+/// EmitProfileHooks - Count and time the calls of an optimized function with
+/// the profile runtime, under the name of its definition.  The hooks go in
+/// last, so they do not keep the function from being optimized as usual, but
+/// a call before the exit hook is no longer a tail call.
+void LLVMCodegen::EmitProfileHooks(llvm::Function *TheFunction, const std::string &Name) {
+  // struct ks_profile_site { const char *Name; uint64_t Calls, Self, Total; uint32_t Id; }
+  // The site is visible outside the module, so that the JIT can give all the
+  // code of a definition one site; a redefinition counts into it as well.
+  llvm::GlobalVariable *Site = TheModule->getNamedGlobal(Name + ".prof");
+  if (!Site) {
+    llvm::Type *I64 = Builder->getInt64Ty();
+    llvm::StructType *SiteTy = llvm::StructType::get(*TheContext, {Builder->getPtrTy(), I64, I64, I64,
+                                                                   Builder->getInt32Ty()});
+    llvm::Constant *SiteName = Builder->CreateGlobalString(Name, Name + ".name", 0, TheModule.get());
+    llvm::Constant *Zero = llvm::ConstantInt::get(I64, 0);
+    Site = new llvm::GlobalVariable(*TheModule, SiteTy, false, llvm::GlobalValue::ExternalLinkage,
+                                    llvm::ConstantStruct::get(SiteTy, {SiteName, Zero, Zero, Zero,
+                                                                       Builder->getInt32(0)}),
+                                    Name + ".prof");
+    Site->setAlignment(llvm::Align(8));
+  }
+
+  llvm::FunctionType *HookTy = llvm::FunctionType::get(Builder->getVoidTy(), {Builder->getPtrTy()}, false);
+  llvm::FunctionCallee Enter = TheModule->getOrInsertFunction("ks_profile_enter", HookTy);
+  llvm::FunctionCallee Exit = TheModule->getOrInsertFunction("ks_profile_exit", HookTy);
+  // The hooks only update the site and the runtime's own state.
+  for (llvm::FunctionCallee Hook : {Enter, Exit}) {
+    auto *HookF = llvm::cast<llvm::Function>(Hook.getCallee());
+    HookF->setDoesNotThrow();
+    HookF->setOnlyAccessesInaccessibleMemOrArgMem();
+    HookF->addFnAttr(llvm::Attribute::WillReturn);
+  }
+
+  llvm::BasicBlock &Entry = TheFunction->getEntryBlock();
+  llvm::IRBuilder<> TmpB(&Entry, Entry.getFirstInsertionPt());
+  TmpB.CreateCall(Enter, {Site});
+  for (auto &BB : *TheFunction)
+    if (auto *Ret = llvm::dyn_cast<llvm::ReturnInst>(BB.getTerminator())) {
+      TmpB.SetInsertPoint(Ret);
+      TmpB.CreateCall(Exit, {Site});
+    }
+
+  // The attributes were inferred without the hooks.  A profiled function
+  // writes memory now, and callers must not merge, drop or hoist its calls.
+  InferFunctionAttributes(*TheFunction);
+}
+
+/// CreateInlineCleanupPasses - The passes that clean up after the operators
+/// have been inlined.
+static llvm::FunctionPassManager CreateInlineCleanupPasses() {
+  llvm::FunctionPassManager FPM;
+  FPM.addPass(llvm::InstCombinePass());
+  FPM.addPass(llvm::ReassociatePass());
+  FPM.addPass(llvm::GVNPass());
+  FPM.addPass(llvm::SimplifyCFGPass());
+  return FPM;
+}
+
+void LLVMCodegen::NewModule(llvm::TargetMachine *TM, bool KeepContext) {
+  // Open a new context, unless asked to reuse the current one, and module.
+  // The analyses of the old module, outer managers first, and then the module
+  // itself must go before its context does.
+  TheTargetMachine = TM;
+  TheMAM.reset();
+  TheCGAM.reset();
+  TheFAM.reset();
+  TheLAM.reset();
+  TheModule.reset();
+  if (!TheContext || !KeepContext)
+    TheContext = std::make_unique<llvm::LLVMContext>();
   TheModule = std::make_unique<llvm::Module>("my cool jit", *TheContext);
-  TheModule->setDataLayout(layout);
-  TheModule->setTargetTriple(triple);
+  TheModule->setDataLayout(TM->createDataLayout());
+  TheModule->setTargetTriple(TM->getTargetTriple().str());
 
   // Create a new builder for the module.
   Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
 
+  Specializations.clear();
+  clearOperators();
+  SpecializedInstructions = 0;
+
   // Create pass and analysis managers
   TheFPM = std::make_unique<llvm::FunctionPassManager>();
+  TheMPM = std::make_unique<llvm::ModulePassManager>();
   TheLAM = std::make_unique<llvm::LoopAnalysisManager>();
   TheFAM = std::make_unique<llvm::FunctionAnalysisManager>();
   TheCGAM = std::make_unique<llvm::CGSCCAnalysisManager>();
   TheMAM = std::make_unique<llvm::ModuleAnalysisManager>();
   ThePIC = std::make_unique<llvm::PassInstrumentationCallbacks>();
-  TheSI = std::make_unique<llvm::StandardInstrumentations>(*TheContext, true);
+  TheSI = std::make_unique<llvm::StandardInstrumentations>(*TheContext, DebugLogging);
   TheSI->registerCallbacks(*ThePIC, TheMAM.get());
 
   // Add transform passes.
@@ -42,14 +314,121 @@ void LLVMCodegen::NewModule(const llvm::DataLayout &layout, const llvm::StringRe
   TheFPM->addPass(llvm::ReassociatePass());
   TheFPM->addPass(llvm::GVNPass());
   TheFPM->addPass(llvm::SimplifyCFGPass());
-
-  // Register analysis passes used in these transform passes.
-  llvm::PassBuilder PB;
+  // Turn self-recursive tail calls into loops and mark the other tail calls.
+  TheFPM->addPass(llvm::TailCallElimPass());
+  // Hoist loop-invariant code, such as calls to pure functions, out of loops,
+  // and turn floating point induction variables into integers where possible.
+  llvm::LoopPassManager LPM;
+  LPM.addPass(llvm::LICMPass(llvm::LICMOptions()));
+  LPM.addPass(llvm::IndVarSimplifyPass());
+  TheFPM->addPass(llvm::createFunctionToLoopPassAdaptor(std::move(LPM), /*UseMemorySSA=*/true));
+  // Vectorize loops over arrays and clean up after the vectorizers.
+  TheVectorizeFPM = std::make_unique<llvm::FunctionPassManager>();
+  TheVectorizeFPM->addPass(llvm::LoopVectorizePass());
+  TheVectorizeFPM->addPass(llvm::SLPVectorizerPass());
+  TheVectorizeFPM->addPass(llvm::InstCombinePass());
+  TheVectorizeFPM->addPass(llvm::SimplifyCFGPass());
+
+  // Functions are instrumented and their profile is read back at the same
+  // point, after the function passes, so both see the same control flow.  The
+  // weights then guide the inliner cleanup and the block layout of codegen.
+  if (Profile.Mode == ProfileOptions::Generate) {
+    TheMPM->addPass(llvm::PGOInstrumentationGen());
+    TheMPM->addPass(llvm::InstrProfiling(llvm::InstrProfOptions()));
+  } else if (Profile.Mode == ProfileOptions::Use) {
+    TheMPM->addPass(llvm::PGOInstrumentationUse(Profile.Path));
+  }
+  // Inline user-defined operators into their callers at module scope and clean
+  // up after them, so that `a | b` costs the same as a builtin operator.
+  TheMPM->addPass(llvm::AlwaysInlinerPass());
+  TheMPM->addPass(llvm::createModuleToFunctionPassAdaptor(CreateInlineCleanupPasses()));
+
+  // Register analysis passes used in these transform passes.  The target
+  // machine provides the cost model the vectorizers need.
+  llvm::PassBuilder PB(TM);
   PB.registerModuleAnalyses(*TheMAM);
   PB.registerFunctionAnalyses(*TheFAM);
+  PB.registerLoopAnalyses(*TheLAM);
   PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
 }
 
+/// RunFunctionPasses - Optimize F, and vectorize it if it takes arrays.
+void LLVMCodegen::RunFunctionPasses(llvm::Function &F) {
+  TheFPM->run(F, *TheFAM);
+  if (llvm::any_of(F.args(), [](llvm::Argument &A) { return A.getType()->isPointerTy(); }))
+    TheVectorizeFPM->run(F, *TheFAM);
+}
+
+/// getOperator - The function of a user-defined operator.  Operators are used
+/// far more often than defined, so they are found by their character instead
+/// of building their name and looking it up in the module every time.
+llvm::Function *LLVMCodegen::getOperator(bool Binary, char Op) {
+  llvm::Function *&F = (Binary ? BinaryOperators : UnaryOperators)[(unsigned char)Op];
+  if (!F)
+    F = getFunction((Binary ? "binary" : "unary") + std::string(1, Op));
+  return F;
+}
+
+/// clearOperators - Forget the operator functions, when they may have been
+/// deleted or replaced.
+void LLVMCodegen::clearOperators() {
+  BinaryOperators.fill(nullptr);
+  UnaryOperators.fill(nullptr);
+}
+
+void LLVMCodegen::OptimizeModule() {
+  // Tell the profile runtime where the instrumented program writes its counts.
+  if (Profile.Mode == ProfileOptions::Generate)
+    llvm::createProfileFileNameVar(*TheModule, Profile.Path);
+  TheMPM->run(*TheModule, *TheMAM);
+  // The inliner deletes internal functions it inlined everywhere.
+  clearOperators();
+}
+
+/// InlineOperators - Inline the user-defined operators M calls and clean up
+/// after them, as OptimizeModule does for the module.  M is another module,
+/// such as a copy of some functions of the module compiled on their own, and
+/// must hold the bodies of the operators.
+void LLVMCodegen::InlineOperators(llvm::Module &M) {
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+  llvm::PassBuilder PB(TheTargetMachine);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  llvm::ModulePassManager MPM;
+  MPM.addPass(llvm::AlwaysInlinerPass());
+  MPM.addPass(llvm::createModuleToFunctionPassAdaptor(CreateInlineCleanupPasses()));
+  MPM.run(M, MAM);
+}
+
+/// RecycleContext - Move the module into a fresh context.  Constants are
+/// interned in the context and never freed, so a long session that erases the
+/// functions it no longer needs still has to drop the old context now and then.
+void LLVMCodegen::RecycleContext() {
+  llvm::SmallVector<char, 0> Bitcode;
+  llvm::raw_svector_ostream OS(Bitcode);
+  llvm::WriteBitcodeToFile(*TheModule, OS);
+
+  // Specializations refer to functions of the old context; keep the budget
+  // spent on them, as the clones themselves come along.
+  unsigned Spent = SpecializedInstructions;
+  NewModule(TheTargetMachine);
+  SpecializedInstructions = Spent;
+  auto M = llvm::parseBitcodeFile(
+    llvm::MemoryBufferRef(llvm::StringRef(Bitcode.data(), Bitcode.size()), "my cool jit"), *TheContext);
+  if (!M) {
+    LogError(llvm::toString(M.takeError()).c_str());
+    return;
+  }
+  TheModule = std::move(*M);
+}
+
 void LLVMCodegen::addFunctionProto(std::string name, std::unique_ptr<PrototypeAST> proto) {
   FunctionProtos[name] = std::move(proto);
 }
@@ -61,6 +440,8 @@ llvm::Value* LLVMCodegen::VisitNumber(NumberExprAST* const ast) {
 llvm::Value* LLVMCodegen::VisitVariable(VariableExprAST* const ast) {
   // Look this variable up in the function.
   llvm::AllocaInst *A = NamedValues[ast->GetName()];
+  if (!A && NamedArrays.count(ast->GetName()))
+    return LogErrorV("Array used as a scalar; index it or pass it to an array argument");
   if (!A)
     return LogErrorV("Unknown variable name");
   // Load the value
@@ -71,12 +452,29 @@ llvm::Value* LLVMCodegen::VisitBinaryExpr(BinaryExprAST* const ast) {
   char Op = ast->GetOp();
   // Special case '=' because we don't want to emit the LHS as an expression.
   if (Op == '=') {
-    // This assume we're building without RTTI because LLVM builds that way by
-    // default. If you build LLVM with RTTI this can be changed to a
-    // dynamic_cast for automatic error checking.
-    VariableExprAST *LHSE = static_cast<VariableExprAST*>(ast->GetLHS());
-    if (!LHSE)
+    // A repeated a[i] on the left is a reference to the first one.
+    ExprAST *LHS = ast->GetLHS();
+    if (LHS->GetKind() == ExprAST::EK_Ref)
+      LHS = static_cast<RefExprAST*>(LHS)->GetTarget();
+
+    // Array element stores go through the element pointer.
+    if (LHS->GetKind() == ExprAST::EK_Index) {
+      llvm::Value *Val = ast->GetRHS()->accept(*this);
+      if (!Val)
+        return nullptr;
+      if (Val->getType()->isVectorTy())
+        return LogErrorV("Cannot store a vector into an array element");
+      llvm::Value *Ptr = CreateElementPtr(static_cast<IndexExprAST*>(LHS));
+      if (!Ptr)
+        return nullptr;
+      Builder->CreateAlignedStore(Val, Ptr, llvm::Align(8));
+      return Val;
+    }
+
+    // ExprAST carries its own kind because LLVM builds without RTTI by default.
+    if (LHS->GetKind() != ExprAST::EK_Variable)
       return LogErrorV("destination of '=' must be a variable");
+    VariableExprAST *LHSE = static_cast<VariableExprAST*>(LHS);
     
     // Codegen the RHS.
     llvm::Value *Val = ast->GetRHS()->accept(*this);
@@ -84,11 +482,14 @@ llvm::Value* LLVMCodegen::VisitBinaryExpr(BinaryExprAST* const ast) {
       return nullptr;
 
     // Look up the name.
-    llvm::Value *Variable = NamedValues[LHSE->GetName()];
+    llvm::AllocaInst *Variable = NamedValues[LHSE->GetName()];
     if (!Variable)
       return LogErrorV("Unknown variable name");
+    if (Variable->getAllocatedType() != Val->getType())
+      return LogErrorV("Cannot assign a vector to a scalar variable or vice versa");
 
     Builder->CreateStore(Val, Variable);
+    ++SharedEpoch;
     return Val;
   }
   auto L = ast->GetLHS()->accept(*this);
@@ -97,6 +498,16 @@ llvm::Value* LLVMCodegen::VisitBinaryExpr(BinaryExprAST* const ast) {
   if (!L || !R)
     return nullptr;
 
+  // Builtin operators work lane-wise on vectors, broadcasting a scalar operand.
+  auto *LVT = llvm::dyn_cast<llvm::FixedVectorType>(L->getType());
+  auto *RVT = llvm::dyn_cast<llvm::FixedVectorType>(R->getType());
+  if (LVT && RVT && LVT != RVT)
+    return LogErrorV("Vector operands have different widths");
+  if (LVT && !RVT)
+    R = Builder->CreateVectorSplat(LVT->getNumElements(), R, "splat");
+  if (RVT && !LVT)
+    L = Builder->CreateVectorSplat(RVT->getNumElements(), L, "splat");
+
   switch (Op) {
   case '+':
     return Builder->CreateFAdd(L, R, "addtmp");
@@ -106,21 +517,137 @@ llvm::Value* LLVMCodegen::VisitBinaryExpr(BinaryExprAST* const ast) {
     return Builder->CreateFMul(L, R, "multmp");
   case '<':
     L = Builder->CreateFCmpULT(L, R, "cmptmp");
-    // Convert bool 0/1 to double 0.0 or 1.0
-    return Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*TheContext), "booltmp");
+    // Convert bool 0/1 to double 0.0 or 1.0, lane-wise for vectors.
+    return Builder->CreateUIToFP(L, R->getType(), "booltmp");
   default:
     break;
   }
 
+  if (LVT || RVT)
+    return LogErrorV("User-defined operators only take scalars");
+
   // If it wasn't a builtin binary operator, it must be a user defined one. Emit
   // a call to it.
-  llvm::Function *F = getFunction(std::string("binary") + ast->GetOp());
+  llvm::Function *F = getOperator(/*Binary=*/true, ast->GetOp());
   assert(F && "binary operator not found!");
 
   llvm::Value *Ops[2] = { L, R };
   return Builder->CreateCall(F, Ops, "binop");
 }
 
+/// LinkBitcode - Add the functions of a bitcode module to the module.
+llvm::Error LLVMCodegen::LinkBitcode(llvm::MemoryBufferRef Bitcode) {
+  auto M = llvm::parseBitcodeFile(Bitcode, *TheContext);
+  if (!M)
+    return M.takeError();
+  // Linking may replace declarations of operators by their definitions.
+  clearOperators();
+  if (llvm::Linker::linkModules(*TheModule, std::move(*M)))
+    return llvm::createStringError(llvm::inconvertibleErrorCode(), "cannot link " + Bitcode.getBufferIdentifier());
+  return llvm::Error::success();
+}
+
+/// CollectLocalGlobals - Add the global variables with local linkage that C
+/// refers to, directly or through other constants, to Globals.
+static void CollectLocalGlobals(llvm::Constant *C, std::set<llvm::GlobalVariable *> &Globals) {
+  if (auto *GV = llvm::dyn_cast<llvm::GlobalVariable>(C)) {
+    if (GV->hasLocalLinkage())
+      Globals.insert(GV);
+    return;
+  }
+  if (llvm::isa<llvm::GlobalValue>(C))
+    return;
+  for (auto &Op : C->operands())
+    if (auto *OpC = llvm::dyn_cast<llvm::Constant>(Op))
+      CollectLocalGlobals(OpC, Globals);
+}
+
+/// eraseFunction - Delete F from the module, together with the parfor kernels,
+/// memo caches and other internal functions and globals only it referred to.
+/// Specializations stay, as later calls may reuse them.
+void LLVMCodegen::eraseFunction(llvm::Function *F) {
+  std::set<llvm::Function *> Keep;
+  for (auto &[Key, Spec] : Specializations)
+    Keep.insert(Spec);
+
+  std::vector<llvm::Function *> Worklist = {F};
+  while (!Worklist.empty()) {
+    llvm::Function *G = Worklist.back();
+    Worklist.pop_back();
+    std::set<llvm::Function *> Referenced;
+    std::set<llvm::GlobalVariable *> Globals;
+    for (auto &I : llvm::instructions(*G))
+      for (auto &Op : I.operands()) {
+        if (auto *H = llvm::dyn_cast<llvm::Function>(Op))
+          Referenced.insert(H);
+        else if (auto *C = llvm::dyn_cast<llvm::Constant>(Op))
+          CollectLocalGlobals(C, Globals);
+      }
+
+    // Cached analyses must not outlive the function they describe.
+    TheFAM->clear(*G, G->getName());
+    for (auto *Operators : {&BinaryOperators, &UnaryOperators})
+      std::replace(Operators->begin(), Operators->end(), G, (llvm::Function *)nullptr);
+    G->eraseFromParent();
+    for (llvm::Function *H : Referenced)
+      if (H != G && H->hasLocalLinkage() && H->use_empty() && !Keep.count(H))
+        Worklist.push_back(H);
+    // Erasing a global can leave the ones its initializer refers to unused.
+    while (!Globals.empty()) {
+      llvm::GlobalVariable *GV = *Globals.begin();
+      Globals.erase(Globals.begin());
+      GV->removeDeadConstantUsers();
+      if (!GV->use_empty())
+        continue;
+      if (GV->hasInitializer())
+        CollectLocalGlobals(GV->getInitializer(), Globals);
+      GV->eraseFromParent();
+    }
+  }
+}
+
+/// redefineFunction - Generate code for a new definition of a function that
+/// is already defined, and make every use of the old definition use the new
+/// one.  The arguments must stay the same, so that calls stay valid.  On error
+/// the old definition stays in place.
+llvm::Function *LLVMCodegen::redefineFunction(FunctionAST *ast) {
+  PrototypeAST &P = *ast->GetProto();
+  std::string Name = P.GetName();
+  llvm::Function *Old = TheModule->getFunction(Name);
+  auto OldProto = FunctionProtos.find(Name);
+  if (!Old || Old->isDeclaration() || OldProto == FunctionProtos.end())
+    return VisitFunction(ast);
+
+  PrototypeAST &OP = *OldProto->second;
+  bool SameArgs = OP.GetArgs().size() == P.GetArgs().size() && OP.IsOperator() == P.IsOperator();
+  for (unsigned i = 0, e = P.GetArgs().size(); SameArgs && i != e; ++i)
+    SameArgs = OP.IsArrayArg(i) == P.IsArrayArg(i);
+  if (!SameArgs) {
+    LogError("A redefinition must take the same arguments");
+    return nullptr;
+  }
+
+  // Move the old definition aside while the new one is generated; recursive
+  // calls in the new body refer to the new function.
+  auto SavedProto = std::make_unique<PrototypeAST>(OP);
+  Old->setName(Name + ".old");
+  clearOperators();
+  llvm::Function *New = VisitFunction(ast);
+  if (!New) {
+    Old->setName(Name);
+    FunctionProtos[Name] = std::move(SavedProto);
+    return nullptr;
+  }
+
+  // Clones of the old body are not reused; they go with the last caller that
+  // still refers to them.
+  std::erase_if(Specializations, [&](auto &Entry) { return Entry.first.first == Old; });
+  Old->replaceAllUsesWith(New);
+  eraseFunction(Old);
+  return New;
+}
+
+
 llvm::Function *LLVMCodegen::getFunction(std::string Name) {
   // First, see if the function has already been added to the current module.
   if (auto *F = TheModule->getFunction(Name))
@@ -136,37 +663,161 @@ llvm::Function *LLVMCodegen::getFunction(std::string Name) {
   return nullptr;
 }
 
+/// IsVectorBuiltin - Whether Name is one of the builtin vector functions
+/// handled by EmitVectorBuiltin.
+static bool IsVectorBuiltin(const std::string &Name) {
+  return Name == "lane" || Name == "hsum" || Name == "hmin" || Name == "hmax" || Name == "shuffle";
+}
+
 llvm::Value* LLVMCodegen::VisitCall(CallExprAST* const ast) {
+  auto &Args = ast->GetArgs();
+  auto PI = FunctionProtos.find(ast->GetCallee());
+  PrototypeAST *Proto = PI != FunctionProtos.end() ? PI->second.get() : nullptr;
+
+  // len(a) is the length of array a, unless the user defined their own len.
+  if (!Proto && ast->GetCallee() == "len" && Args.size() == 1 && Args[0]->GetKind() == ExprAST::EK_Variable) {
+    auto AI = NamedArrays.find(static_cast<VariableExprAST*>(Args[0].get())->GetName());
+    if (AI != NamedArrays.end())
+      return Builder->CreateSIToFP(AI->second.Len, llvm::Type::getDoubleTy(*TheContext), "lentmp");
+  }
+
+  // Vector builtins, unless the user defined a function of the same name.
+  if (!Proto && IsVectorBuiltin(ast->GetCallee()))
+    return EmitVectorBuiltin(ast);
+
   // Look up the name in the global module table.
   llvm::Function *CalleeF = getFunction(ast->GetCallee());
   if (!CalleeF)
     return LogErrorV("Unknown function referenced");
 
   // If argument mismatch error.
-  if (CalleeF->arg_size() != ast->GetArgs().size())
+  if ((Proto ? Proto->GetArgs().size() : CalleeF->arg_size()) != Args.size())
     return LogErrorV("Incorrect # arguments passed");
 
   std::vector<llvm::Value *> ArgsV;
-  for (unsigned i = 0, e = ast->GetArgs().size(); i != e; ++i) {
-    ArgsV.push_back(ast->GetArgs()[i]->accept(*this));
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    if (Proto && Proto->IsArrayArg(i)) {
+      // Arrays are passed on as their pointer and length.
+      auto AI = NamedArrays.end();
+      if (Args[i]->GetKind() == ExprAST::EK_Variable)
+        AI = NamedArrays.find(static_cast<VariableExprAST*>(Args[i].get())->GetName());
+      if (AI == NamedArrays.end())
+        return LogErrorV("Expected an array argument");
+      // Array arguments are noalias, so they must be different arrays.
+      if (std::find(ArgsV.begin(), ArgsV.end(), AI->second.Ptr) != ArgsV.end())
+        return LogErrorV("The same array cannot be passed twice");
+      ArgsV.push_back(AI->second.Ptr);
+      ArgsV.push_back(AI->second.Len);
+      continue;
+    }
+    ArgsV.push_back(Args[i]->accept(*this));
     if (!ArgsV.back())
       return nullptr;
+    if (ArgsV.back()->getType()->isVectorTy())
+      return LogErrorV("Functions only take scalar arguments");
   }
 
+  if (llvm::Function *SpecF = Specialize(CalleeF, ArgsV))
+    return Builder->CreateCall(SpecF, ArgsV, "calltmp");
+
   return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
 }
 
+/// MaxSpecializedSize - Functions bigger than this many instructions are
+/// never specialized.
+static const unsigned MaxSpecializedSize = 500;
+
+/// SpecializationBudget - Total number of instructions all specializations in
+/// a module may add.
+static const unsigned SpecializationBudget = 20000;
+
+/// Specialize - Return a clone of Callee with its constant arguments bound and
+/// optimized away, and drop those arguments from Args.  Returns null and leaves
+/// Args alone if no argument is constant or the clone would be too big.
+llvm::Function *LLVMCodegen::Specialize(llvm::Function *Callee, std::vector<llvm::Value *> &Args) {
+  // Operators are inlined anyway, and functions being generated are not
+  // finished yet.
+  if (Callee->isDeclaration() || Callee->hasFnAttribute(llvm::Attribute::AlwaysInline) ||
+      Unfinished.count(Callee))
+    return nullptr;
+
+  std::vector<std::pair<unsigned, uint64_t>> Signature;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    if (auto *C = llvm::dyn_cast<llvm::ConstantFP>(Args[i]))
+      Signature.push_back({i, C->getValueAPF().bitcastToAPInt().getZExtValue()});
+  if (Signature.empty())
+    return nullptr;
+
+  llvm::Function *&SpecF = Specializations[{Callee, Signature}];
+  if (!SpecF) {
+    unsigned Size = Callee->getInstructionCount();
+    if (Size > MaxSpecializedSize || SpecializedInstructions + Size > SpecializationBudget)
+      return nullptr;
+
+    llvm::ValueToValueMapTy VMap;
+    for (auto &[Idx, Bits] : Signature)
+      VMap[Callee->getArg(Idx)] = Args[Idx];
+    SpecF = llvm::CloneFunction(Callee, VMap);
+    SpecF->setName(Callee->getName() + ".spec");
+    SpecF->setLinkage(llvm::GlobalValue::InternalLinkage);
+
+    // The clone takes fewer arguments, so its tail calls can no longer be
+    // guaranteed until the prototypes are compared again.
+    for (auto &I : llvm::instructions(SpecF))
+      if (auto *CI = llvm::dyn_cast<llvm::CallInst>(&I))
+        if (CI->isMustTailCall())
+          CI->setTailCallKind(llvm::CallInst::TCK_Tail);
+
+    RunFunctionPasses(*SpecF);
+    InferFunctionAttributes(*SpecF);
+    MarkMustTailCalls(*SpecF);
+    TheFAM->clear(*SpecF, SpecF->getName());
+    SpecializedInstructions += SpecF->getInstructionCount();
+  }
+
+  std::vector<llvm::Value *> Rest;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    if (!llvm::isa<llvm::ConstantFP>(Args[i]))
+      Rest.push_back(Args[i]);
+  Args = std::move(Rest);
+  return SpecF;
+}
+
 llvm::Function* LLVMCodegen::VisitPrototype(PrototypeAST* const ast) {
-  // Make the function type:  double(double,double) etc.
-  std::vector<llvm::Type *> Doubles(ast->GetArgs().size(), llvm::Type::getDoubleTy(*TheContext));
-  llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getDoubleTy(*TheContext), Doubles, false);
+  // Make the function type:  double(double,double) etc.  Array arguments are
+  // passed as a pointer followed by an i64 length.
+  std::vector<llvm::Type *> Params;
+  for (unsigned i = 0, e = ast->GetArgs().size(); i != e; ++i) {
+    if (ast->IsArrayArg(i)) {
+      Params.push_back(llvm::PointerType::getUnqual(*TheContext));
+      Params.push_back(llvm::Type::getInt64Ty(*TheContext));
+    } else {
+      Params.push_back(llvm::Type::getDoubleTy(*TheContext));
+    }
+  }
+  llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getDoubleTy(*TheContext), Params, false);
 
   llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, ast->GetName(), *TheModule);
 
-  // Set names for all arguments.
+  // Set names for all arguments.  Array arguments never alias each other and
+  // hold aligned doubles, which is what lets loops over them vectorize.
   unsigned Idx = 0;
-  for (auto &Arg : F->args())
-    Arg.setName(ast->GetArgs()[Idx++]);
+  for (unsigned i = 0, e = ast->GetArgs().size(); i != e; ++i) {
+    llvm::Argument *Arg = F->getArg(Idx++);
+    Arg->setName(ast->GetArgs()[i]);
+    if (ast->IsArrayArg(i)) {
+      Arg->addAttr(llvm::Attribute::NoAlias);
+      Arg->addAttr(llvm::Attribute::getWithAlignment(*TheContext, llvm::Align(8)));
+      F->getArg(Idx++)->setName(ast->GetArgs()[i] + ".len");
+    }
+  }
+
+  // User-defined operators are tiny; always inline them into their callers.
+  if (ast->IsOperator())
+    F->addFnAttr(llvm::Attribute::AlwaysInline);
+
+  // Known pure C functions can be CSE'd, hoisted and deleted like builtins.
+  AddLibCallAttributes(*F);
 
   return F;
 }
@@ -174,11 +825,18 @@ llvm::Function* LLVMCodegen::VisitPrototype(PrototypeAST* const ast) {
 llvm::Function* LLVMCodegen::VisitFunction(FunctionAST* const ast) {
   // TODO: https://llvm.org/docs/tutorial/MyFirstLanguageFrontend/LangImpl03.html#function-code-generation
 
-  // Transfer ownership of the prototype to the FunctionProtos map, but keep a
-  // reference to it for use below.
-  auto proto = ast->GetProto();
-  auto &P = *proto;
-  addFunctionProto(proto->GetName(), std::move(proto));
+  // Redefinitions go through redefineFunction, which moves the old body aside.
+  // Only the first top-level expression of a module is kept.
+  if (auto *Old = TheModule->getFunction(ast->GetProto()->GetName());
+      Old && !Old->isDeclaration() && ast->GetProto()->GetName() != "__anon_expr") {
+    LogError("Function cannot be redefined");
+    return nullptr;
+  }
+
+  // Copy the prototype to the FunctionProtos map, keeping the AST intact so
+  // that the definition can be generated again.
+  addFunctionProto(ast->GetProto()->GetName(), std::make_unique<PrototypeAST>(*ast->GetProto()));
+  auto &P = *ast->GetProto();
   llvm::Function *TheFunction = getFunction(P.GetName());
   if (!TheFunction)
     return nullptr;
@@ -186,20 +844,35 @@ llvm::Function* LLVMCodegen::VisitFunction(FunctionAST* const ast) {
   // Create a new basic block to start insertion into.
   auto BB = llvm::BasicBlock::Create(*TheContext, "entry", TheFunction);
   Builder->SetInsertPoint(BB);
+  Unfinished.insert(TheFunction);
+  SharedValues.clear();
+  PureExprs.clear();
 
-  // Record the function arguments in the NamedValues map.
+  // Record the function arguments in the NamedValues and NamedArrays maps.
   NamedValues.clear();
-  for (auto &Arg : TheFunction->args()) {
+  NamedArrays.clear();
+  LoopIndices.clear();
+  unsigned Idx = 0;
+  for (unsigned i = 0, e = P.GetArgs().size(); i != e; ++i) {
+    const std::string &ArgName = P.GetArgs()[i];
+    llvm::Argument *Arg = TheFunction->getArg(Idx++);
+    if (P.IsArrayArg(i)) {
+      NamedArrays[ArgName] = {Arg, TheFunction->getArg(Idx++)};
+      continue;
+    }
     // Create an alloca for this variable.
-    std::string ArgName = std::string(Arg.getName());
     llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, ArgName);
     // Store the initial value into the alloca.
-    Builder->CreateStore(&Arg, Alloca);
+    Builder->CreateStore(Arg, Alloca);
     // Add arguments to variable symbol table.
     NamedValues[ArgName] = Alloca;
   }
   
-  if (llvm::Value *RetVal = ast->GetBody()->accept(*this)) {
+  llvm::Value *RetVal = ast->GetBody()->accept(*this);
+  Unfinished.erase(TheFunction);
+  if (RetVal && RetVal->getType()->isVectorTy())
+    RetVal = LogErrorV("Functions must return a scalar; reduce the vector first");
+  if (RetVal) {
     // Finish off the function.
     Builder->CreateRet(RetVal);
 
@@ -207,11 +880,37 @@ llvm::Function* LLVMCodegen::VisitFunction(FunctionAST* const ast) {
     llvm::verifyFunction(*TheFunction);
 
     // Optimize the function
-    TheFPM->run(*TheFunction, *TheFAM);
+    RunFunctionPasses(*TheFunction);
+
+    // Infer purity from the optimized body so later callers can treat calls to
+    // this function like builtin arithmetic.  Self-recursive calls only learn
+    // the new attributes now, so give them another round of optimization.
+    if (InferFunctionAttributes(*TheFunction))
+      RunFunctionPasses(*TheFunction);
+
+    if (ast->IsMemo()) {
+      // Caching results is only transparent for functions without side effects.
+      if (!TheFunction->doesNotAccessMemory()) {
+        LogError("memo function must not access memory or call impure functions");
+        eraseFunction(TheFunction);
+        return nullptr;
+      }
+      EmitMemoCache(TheFunction);
+      RunFunctionPasses(*TheFunction);
+    }
+
+    if (Profile.Calls && P.GetName() != "__anon_expr")
+      EmitProfileHooks(TheFunction, P.GetName());
+
+    MarkMustTailCalls(*TheFunction);
+
+    // The function is final.  Free its dominator trees, alias and loop info
+    // now instead of keeping them for every function until the module goes.
+    TheFAM->clear(*TheFunction, TheFunction->getName());
 
     return TheFunction;
   }
-  TheFunction->eraseFromParent();
+  eraseFunction(TheFunction);
   return nullptr;
 }
 
@@ -219,6 +918,8 @@ llvm::Value* LLVMCodegen::VisitIf(IfExprAST* const ast) {
   llvm::Value* CondV = ast->GetCond()->accept(*this);
   if (!CondV)
     return nullptr;
+  if (CondV->getType()->isVectorTy())
+    return LogErrorV("Condition must be a scalar");
 
   // Convert condition to a bool by comparing non-equal to 0.0.
   CondV = Builder->CreateFCmpONE(CondV, llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0)), "ifcond");
@@ -258,13 +959,126 @@ llvm::Value* LLVMCodegen::VisitIf(IfExprAST* const ast) {
   // Emit merge block.
   TheFunction->insert(TheFunction->end(), MergeBB);
   Builder->SetInsertPoint(MergeBB);
-  llvm::PHINode *PN = Builder->CreatePHI(llvm::Type::getDoubleTy(*TheContext), 2, "iftmp");
+  if (ThenV->getType() != ElseV->getType())
+    return LogErrorV("Both branches of an if must be scalars or vectors of the same width");
+  llvm::PHINode *PN = Builder->CreatePHI(ThenV->getType(), 2, "iftmp");
 
   PN->addIncoming(ThenV, ThenBB);
   PN->addIncoming(ElseV, ElseBB);
   return PN;
 }
 
+/// GetIntegerConstant - The value of E if it is a number literal holding an
+/// integer, which a double represents exactly.
+static std::optional<int64_t> GetIntegerConstant(ExprAST *E) {
+  if (!E || E->GetKind() != ExprAST::EK_Number)
+    return std::nullopt;
+  double V = static_cast<NumberExprAST*>(E)->GetVal();
+  if (V != std::trunc(V) || std::fabs(V) > 0x1p53)
+    return std::nullopt;
+  return (int64_t)V;
+}
+
+/// AssignsVariable - Whether E may assign the variable Name.
+static bool AssignsVariable(ExprAST *E, const std::string &Name) {
+  if (!E)
+    return false;
+  switch (E->GetKind()) {
+  case ExprAST::EK_Number:
+  case ExprAST::EK_Variable:
+    return false;
+  case ExprAST::EK_Binary: {
+    auto *B = static_cast<BinaryExprAST*>(E);
+    if (B->GetOp() == '=' && B->GetLHS()->GetKind() == ExprAST::EK_Variable &&
+        static_cast<VariableExprAST*>(B->GetLHS())->GetName() == Name)
+      return true;
+    return AssignsVariable(B->GetLHS(), Name) || AssignsVariable(B->GetRHS(), Name);
+  }
+  case ExprAST::EK_Call:
+    for (auto &Arg : static_cast<CallExprAST*>(E)->GetArgs())
+      if (AssignsVariable(Arg.get(), Name))
+        return true;
+    return false;
+  case ExprAST::EK_If: {
+    auto *I = static_cast<IfExprAST*>(E);
+    return AssignsVariable(I->GetCond(), Name) || AssignsVariable(I->GetThen(), Name) ||
+           AssignsVariable(I->GetElse(), Name);
+  }
+  case ExprAST::EK_For: {
+    auto *F = static_cast<ForExprAST*>(E);
+    return AssignsVariable(F->GetStart(), Name) || AssignsVariable(F->GetEnd(), Name) ||
+           AssignsVariable(F->GetStep(), Name) || AssignsVariable(F->GetBody(), Name);
+  }
+  case ExprAST::EK_Unary:
+    return AssignsVariable(static_cast<UnaryExprAST*>(E)->GetOperand(), Name);
+  case ExprAST::EK_Var: {
+    auto *V = static_cast<VarExprAST*>(E);
+    for (auto &[VarName, Init] : *V->GetVarNames())
+      if (AssignsVariable(Init.get(), Name))
+        return true;
+    return AssignsVariable(V->GetBody(), Name);
+  }
+  case ExprAST::EK_Index:
+    return AssignsVariable(static_cast<IndexExprAST*>(E)->GetIndex(), Name);
+  case ExprAST::EK_Vector:
+    for (auto &Element : static_cast<VectorExprAST*>(E)->GetElements())
+      if (AssignsVariable(Element.get(), Name))
+        return true;
+    return false;
+  case ExprAST::EK_Ref:
+    return AssignsVariable(static_cast<RefExprAST*>(E)->GetTarget(), Name);
+  }
+  return true;
+}
+
+/// EmitCountedFor - Generate `for i = Start, i < len(a), Step in body` with an
+/// i64 induction variable, testing the condition before every iteration so
+/// that i stays within a.  The trip count is then known to the vectorizer.
+llvm::Value *LLVMCodegen::EmitCountedFor(ForExprAST *ast, const ArrayValue &Array, int64_t Start, int64_t Step) {
+  llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  const std::string &VarName = ast->GetVarName();
+  llvm::Type *I64 = Builder->getInt64Ty();
+  llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+
+  llvm::BasicBlock *PreheaderBB = Builder->GetInsertBlock();
+  llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(*TheContext, "loop", TheFunction);
+  llvm::BasicBlock *AfterBB = llvm::BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+  llvm::Value *StartV = llvm::ConstantInt::get(I64, Start);
+  Builder->CreateCondBr(Builder->CreateICmpSLT(StartV, Array.Len, "loopentry"), LoopBB, AfterBB);
+
+  Builder->SetInsertPoint(LoopBB);
+  llvm::PHINode *Index = Builder->CreatePHI(I64, 2, VarName + ".idx");
+  Index->addIncoming(StartV, PreheaderBB);
+  Builder->CreateStore(Builder->CreateSIToFP(Index, Builder->getDoubleTy(), VarName), Alloca);
+
+  llvm::AllocaInst *OldVal = NamedValues[VarName];
+  NamedValues[VarName] = Alloca;
+  std::optional<LoopIndex> OldIndex;
+  if (auto LI = LoopIndices.find(VarName); LI != LoopIndices.end())
+    OldIndex = LI->second;
+  LoopIndices[VarName] = {Alloca, Index};
+
+  llvm::Value *Body = ast->GetBody()->accept(*this);
+
+  if (OldVal)
+    NamedValues[VarName] = OldVal;
+  else
+    NamedValues.erase(VarName);
+  if (OldIndex)
+    LoopIndices[VarName] = *OldIndex;
+  else
+    LoopIndices.erase(VarName);
+  if (!Body)
+    return nullptr;
+
+  llvm::Value *Next = Builder->CreateNSWAdd(Index, llvm::ConstantInt::get(I64, Step), "nextidx");
+  Index->addIncoming(Next, Builder->GetInsertBlock());
+  Builder->CreateCondBr(Builder->CreateICmpSLT(Next, Array.Len, "loopcond"), LoopBB, AfterBB);
+
+  Builder->SetInsertPoint(AfterBB);
+  return llvm::Constant::getNullValue(Builder->getDoubleTy());
+}
+
 // Output for-loop as:
 //   var = alloca double
 //   ...
@@ -285,8 +1099,37 @@ llvm::Value* LLVMCodegen::VisitIf(IfExprAST* const ast) {
 //   br endcond, loop, endloop
 // outloop:
 llvm::Value* LLVMCodegen::VisitFor(ForExprAST* const ast) {
-  llvm::Function* TheFunction = Builder->GetInsertBlock()->getParent();
+  if (ast->IsParallel())
+    return EmitParallelFor(ast);
+
+  // A loop over the elements of an array, `for i = 0, i < len(a) in ...` with
+  // constant integer start and step, counts with an integer.  Testing the
+  // condition after the body, as other loops do, would overrun the array.
   std::string VarName = ast->GetVarName();
+  ExprAST *End = ast->GetEnd();
+  if (End->GetKind() == ExprAST::EK_Ref)
+    End = static_cast<RefExprAST*>(End)->GetTarget();
+  auto CountStart = GetIntegerConstant(ast->GetStart());
+  auto CountStep = ast->GetStep() ? GetIntegerConstant(ast->GetStep()) : std::optional<int64_t>(1);
+  if (CountStart && CountStep && *CountStep > 0 && End->GetKind() == ExprAST::EK_Binary &&
+      static_cast<BinaryExprAST*>(End)->GetOp() == '<' && !AssignsVariable(ast->GetBody(), VarName)) {
+    ExprAST *LHS = static_cast<BinaryExprAST*>(End)->GetLHS();
+    ExprAST *RHS = static_cast<BinaryExprAST*>(End)->GetRHS();
+    if (RHS->GetKind() == ExprAST::EK_Ref)
+      RHS = static_cast<RefExprAST*>(RHS)->GetTarget();
+    if (LHS->GetKind() == ExprAST::EK_Variable && static_cast<VariableExprAST*>(LHS)->GetName() == VarName &&
+        RHS->GetKind() == ExprAST::EK_Call && !FunctionProtos.count("len")) {
+      auto *Len = static_cast<CallExprAST*>(RHS);
+      if (Len->GetCallee() == "len" && Len->GetArgs().size() == 1 &&
+          Len->GetArgs()[0]->GetKind() == ExprAST::EK_Variable) {
+        auto AI = NamedArrays.find(static_cast<VariableExprAST*>(Len->GetArgs()[0].get())->GetName());
+        if (AI != NamedArrays.end())
+          return EmitCountedFor(ast, AI->second, *CountStart, *CountStep);
+      }
+    }
+  }
+
+  llvm::Function* TheFunction = Builder->GetInsertBlock()->getParent();
 
   // Create an alloca for the variable in the entry block.
   llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
@@ -295,6 +1138,8 @@ llvm::Value* LLVMCodegen::VisitFor(ForExprAST* const ast) {
   llvm::Value *StartVal = ast->GetStart()->accept(*this);
   if (!StartVal)
     return nullptr;
+  if (StartVal->getType()->isVectorTy())
+    return LogErrorV("Loop variable must be a scalar");
   
   // Store the value into the alloca.
   Builder->CreateStore(StartVal, Alloca);
@@ -326,6 +1171,8 @@ llvm::Value* LLVMCodegen::VisitFor(ForExprAST* const ast) {
     StepVal = Step->accept(*this);
     if (!StepVal)
       return nullptr;
+    if (StepVal->getType()->isVectorTy())
+      return LogErrorV("Loop step must be a scalar");
   } else {
     // If not specified, use 1.0.
     StepVal = llvm::ConstantFP::get(*TheContext, llvm::APFloat(1.0));
@@ -335,6 +1182,8 @@ llvm::Value* LLVMCodegen::VisitFor(ForExprAST* const ast) {
   llvm::Value *EndCond = ast->GetEnd()->accept(*this);
   if (!EndCond)
     return nullptr;
+  if (EndCond->getType()->isVectorTy())
+    return LogErrorV("Loop condition must be a scalar");
   
   // Reload, increment, and restore the alloca. This handles the case where the body of the loop mutates the variable.
   llvm::Value *CurVar = Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, VarName.c_str());
@@ -367,8 +1216,10 @@ llvm::Value* LLVMCodegen::VisitUnary(UnaryExprAST* const ast) {
   llvm::Value *OperandV = ast->GetOperand()->accept(*this);
   if (!OperandV)
     return nullptr;
+  if (OperandV->getType()->isVectorTy())
+    return LogErrorV("User-defined operators only take scalars");
 
-  llvm::Function *F = getFunction(std::string("unary") + ast->GetOpcode());
+  llvm::Function *F = getOperator(/*Binary=*/false, ast->GetOpcode());
   if (!F)
     return LogErrorV("Unknown unary operator");
 
@@ -399,7 +1250,7 @@ llvm::Value* LLVMCodegen::VisitVar(VarExprAST* const ast) {
       InitVal = llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0));
     }
 
-    llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+    llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName, InitVal->getType());
     Builder->CreateStore(InitVal, Alloca);
 
     // Remember the old variable binding so that we can restore the binding when
@@ -408,6 +1259,7 @@ llvm::Value* LLVMCodegen::VisitVar(VarExprAST* const ast) {
 
     // Remember this binding.
     NamedValues[VarName] = Alloca;
+    ++SharedEpoch;
   }
   // Codegen the body, now that all vars are in scope.
   llvm::Value *BodyVal = ast->GetBody()->accept(*this);
@@ -417,7 +1269,391 @@ llvm::Value* LLVMCodegen::VisitVar(VarExprAST* const ast) {
   // Pop all our variables from scope.
   for (size_t i = 0, e = VarNames->size(); i != e; ++i)
     NamedValues[(*VarNames)[i].first] = OldBindings[i];
+  ++SharedEpoch;
 
   // Return the body computation.
   return BodyVal;
+}
+
+/// IsPure - Whether an expression reads no array and calls nothing that
+/// accesses memory or may not return, so that its occurrences compute the
+/// same value as long as the variables it reads keep theirs.
+bool LLVMCodegen::IsPure(ExprAST *ast) {
+  switch (ast->GetKind()) {
+  case ExprAST::EK_Number:
+  case ExprAST::EK_Variable:
+    return true;
+  case ExprAST::EK_Ref:
+    return IsPure(static_cast<RefExprAST*>(ast)->GetTarget());
+  default:
+    break;
+  }
+  auto Known = PureExprs.find(ast);
+  if (Known != PureExprs.end())
+    return Known->second;
+
+  auto IsPureFunction = [](llvm::Function *F) { return F && F->doesNotAccessMemory() && F->willReturn(); };
+  bool Pure = false;
+  switch (ast->GetKind()) {
+  case ExprAST::EK_Binary: {
+    auto *B = static_cast<BinaryExprAST*>(ast);
+    char Op = B->GetOp();
+    bool Builtin = Op == '+' || Op == '-' || Op == '*' || Op == '<';
+    Pure = Op != '=' && (Builtin || IsPureFunction(getOperator(/*Binary=*/true, Op))) && IsPure(B->GetLHS()) &&
+           IsPure(B->GetRHS());
+    break;
+  }
+  case ExprAST::EK_Unary: {
+    auto *U = static_cast<UnaryExprAST*>(ast);
+    Pure = IsPureFunction(getOperator(/*Binary=*/false, U->GetOpcode())) && IsPure(U->GetOperand());
+    break;
+  }
+  case ExprAST::EK_Call: {
+    auto *C = static_cast<CallExprAST*>(ast);
+    const std::string &Callee = C->GetCallee();
+    bool Builtin = !FunctionProtos.count(Callee) && (Callee == "len" || IsVectorBuiltin(Callee));
+    Pure = (Builtin || IsPureFunction(TheModule->getFunction(Callee))) &&
+           llvm::all_of(C->GetArgs(), [&](auto &Arg) { return IsPure(Arg.get()); });
+    break;
+  }
+  default:
+    break;
+  }
+  PureExprs[ast] = Pure;
+  return Pure;
+}
+
+/// VisitShared - Emit an expression that occurs more than once in the
+/// definition.  A pure one is emitted once per block and reused until a
+/// variable is assigned or bound; others are emitted again at every
+/// occurrence.
+llvm::Value* LLVMCodegen::VisitShared(ExprAST* const ast) {
+  auto Cached = SharedValues.find(ast);
+  if (Cached != SharedValues.end() && Cached->second.Block == Builder->GetInsertBlock() &&
+      Cached->second.Epoch == SharedEpoch)
+    return Cached->second.Value;
+
+  llvm::Value *V;
+  switch (ast->GetKind()) {
+  case ExprAST::EK_Binary:
+    V = VisitBinaryExpr(static_cast<BinaryExprAST*>(ast));
+    break;
+  case ExprAST::EK_Unary:
+    V = VisitUnary(static_cast<UnaryExprAST*>(ast));
+    break;
+  case ExprAST::EK_Call:
+    V = VisitCall(static_cast<CallExprAST*>(ast));
+    break;
+  case ExprAST::EK_Index:
+    V = VisitIndex(static_cast<IndexExprAST*>(ast));
+    break;
+  default:
+    llvm_unreachable("only binary, unary, call and index expressions are shared");
+  }
+  if (V && IsPure(ast))
+    SharedValues[ast] = {Builder->GetInsertBlock(), SharedEpoch, V};
+  return V;
+}
+
+/// CreateElementPtr - Compute the address of the array element a[i].  The index
+/// is truncated towards zero and not bounds checked.
+llvm::Value *LLVMCodegen::CreateElementPtr(IndexExprAST *ast) {
+  auto AI = NamedArrays.find(ast->GetName());
+  if (AI == NamedArrays.end())
+    return LogErrorV("Unknown array name");
+
+  llvm::Value *IndexV = ast->GetIndex()->accept(*this);
+  if (!IndexV)
+    return nullptr;
+  if (IndexV->getType()->isVectorTy())
+    return LogErrorV("Array index must be a scalar");
+
+  // The variable of a counted loop indexes with its integer induction
+  // variable, which keeps the accesses consecutive for the vectorizer.
+  if (ast->GetIndex()->GetKind() == ExprAST::EK_Variable) {
+    const std::string &Var = static_cast<VariableExprAST*>(ast->GetIndex())->GetName();
+    auto LI = LoopIndices.find(Var);
+    auto VI = NamedValues.find(Var);
+    if (LI != LoopIndices.end() && VI != NamedValues.end() && VI->second == LI->second.Var)
+      return Builder->CreateInBoundsGEP(llvm::Type::getDoubleTy(*TheContext), AI->second.Ptr, LI->second.Index,
+                                        "eltptr");
+  }
+  IndexV = Builder->CreateFPToSI(IndexV, llvm::Type::getInt64Ty(*TheContext), "idxtmp");
+  return Builder->CreateInBoundsGEP(llvm::Type::getDoubleTy(*TheContext), AI->second.Ptr, IndexV, "eltptr");
+}
+
+llvm::Value* LLVMCodegen::VisitIndex(IndexExprAST* const ast) {
+  llvm::Value *Ptr = CreateElementPtr(ast);
+  if (!Ptr)
+    return nullptr;
+  return Builder->CreateAlignedLoad(llvm::Type::getDoubleTy(*TheContext), Ptr, llvm::Align(8), ast->GetName().c_str());
+}
+
+/// GetNativeVectorWidth - Number of doubles that fit in a vector register of
+/// the target, as selected by the CPU and features of the target machine.
+unsigned LLVMCodegen::GetNativeVectorWidth() {
+  llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  llvm::TargetTransformInfo TTI = TheTargetMachine->getTargetTransformInfo(*TheFunction);
+  uint64_t Bits = TTI.getRegisterBitWidth(llvm::TargetTransformInfo::RGK_FixedWidthVector).getFixedValue();
+  return std::max<uint64_t>(Bits / 64, 1);
+}
+
+llvm::Value* LLVMCodegen::VisitVector(VectorExprAST* const ast) {
+  unsigned Width = ast->GetWidth() ? ast->GetWidth() : GetNativeVectorWidth();
+
+  std::vector<llvm::Value *> Elements;
+  for (auto &Element : ast->GetElements()) {
+    Elements.push_back(Element->accept(*this));
+    if (!Elements.back())
+      return nullptr;
+    if (Elements.back()->getType()->isVectorTy())
+      return LogErrorV("Vector elements must be scalars");
+  }
+
+  if (Elements.size() == 1)
+    return Builder->CreateVectorSplat(Width, Elements[0], "splat");
+
+  llvm::Value *V = llvm::PoisonValue::get(llvm::FixedVectorType::get(llvm::Type::getDoubleTy(*TheContext), Width));
+  for (unsigned i = 0; i != Width; ++i)
+    V = Builder->CreateInsertElement(V, Elements[i], Builder->getInt64(i), "vectmp");
+  return V;
+}
+
+/// EmitVectorBuiltin - Emit one of the builtin vector functions:
+///   lane(v, i)               element i of v, i modulo the width of v unless
+///                            it is a constant
+///   hsum(v), hmin(v), hmax(v) horizontal sum, minimum or maximum of v
+///   shuffle(v, i0, i1, ...)  vector of v[i0], v[i1], ... for constant indices
+llvm::Value *LLVMCodegen::EmitVectorBuiltin(CallExprAST *ast) {
+  const std::string &Name = ast->GetCallee();
+  auto &Args = ast->GetArgs();
+  if (Args.empty())
+    return LogErrorV("Vector builtin expects a vector argument");
+
+  llvm::Value *V = Args[0]->accept(*this);
+  if (!V)
+    return nullptr;
+  auto *VT = llvm::dyn_cast<llvm::FixedVectorType>(V->getType());
+  if (!VT)
+    return LogErrorV("Vector builtin expects a vector argument");
+
+  if (Name == "hsum" || Name == "hmin" || Name == "hmax") {
+    if (Args.size() != 1)
+      return LogErrorV("Incorrect # arguments passed");
+    if (Name == "hmin")
+      return Builder->CreateFPMinReduce(V);
+    if (Name == "hmax")
+      return Builder->CreateFPMaxReduce(V);
+    // Sum in lane order, starting from -0.0 so that -0.0 lanes are preserved.
+    return Builder->CreateFAddReduce(llvm::ConstantFP::getNegativeZero(Builder->getDoubleTy()), V);
+  }
+
+  if (Name == "lane") {
+    if (Args.size() != 2)
+      return LogErrorV("Incorrect # arguments passed");
+    llvm::Value *IndexV = Args[1]->accept(*this);
+    if (!IndexV)
+      return nullptr;
+    if (IndexV->getType()->isVectorTy())
+      return LogErrorV("Lane index must be a scalar");
+    if (auto *C = llvm::dyn_cast<llvm::ConstantFP>(IndexV))
+      if (!C->getValueAPF().isInteger() || C->getValueAPF().isNegative() ||
+          C->getValueAPF().convertToDouble() >= VT->getNumElements())
+        return LogErrorV("lane index must be a constant lane of the vector or a variable");
+    // A variable index is truncated, saturating, and wraps around the lanes,
+    // as an out of range extractelement would be poison.
+    IndexV = Builder->CreateIntrinsic(llvm::Intrinsic::fptosi_sat, {Builder->getInt64Ty(), Builder->getDoubleTy()},
+                                      {IndexV}, nullptr, "lanetmp");
+    IndexV = Builder->CreateURem(IndexV, Builder->getInt64(VT->getNumElements()), "laneidx");
+    return Builder->CreateExtractElement(V, IndexV, "lane");
+  }
+
+  // shuffle: every index must fold to a constant lane number.
+  if (Args.size() < 2)
+    return LogErrorV("shuffle expects a vector and at least one lane index");
+  std::vector<int> Mask;
+  for (unsigned i = 1, e = Args.size(); i != e; ++i) {
+    auto *C = llvm::dyn_cast_or_null<llvm::ConstantFP>(Args[i]->accept(*this));
+    if (!C || !C->getValueAPF().isInteger() || C->getValueAPF().isNegative() ||
+        C->getValueAPF().convertToDouble() >= VT->getNumElements())
+      return LogErrorV("shuffle lane indices must be constant lanes of the vector");
+    Mask.push_back((int)C->getValueAPF().convertToDouble());
+  }
+  return Builder->CreateShuffleVector(V, Mask, "shuffle");
+}
+
+// Output parfor-loop as a call into the work-stealing runtime:
+//   env = { start, step, captured variables..., captured arrays... }
+//   trip = max(0, ceil((end - start) / step))
+//   result = ks_parallel_for(trip, kernel, &env, reduceop)
+// where the outlined kernel runs a chunk of iterations:
+//   double kernel(i64 lo, i64 hi, ptr env) {
+//     acc = identity of reduceop
+//     for k in [lo, hi):
+//       var = start + k * step
+//       acc = acc reduceop bodyexpr
+//     return acc
+//   }
+// Variables in scope are captured by value, so assigning them in the body only
+// changes the chunk's copy; arrays are shared.
+llvm::Value *LLVMCodegen::EmitParallelFor(ForExprAST *ast) {
+  llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  llvm::Type *DoubleTy = Builder->getDoubleTy();
+  llvm::Type *I64 = Builder->getInt64Ty();
+
+  // Start, bound and step are evaluated once, before the loop.
+  llvm::Value *StartVal = ast->GetStart()->accept(*this);
+  if (!StartVal)
+    return nullptr;
+  llvm::Value *EndVal = ast->GetEnd()->accept(*this);
+  if (!EndVal)
+    return nullptr;
+  llvm::Value *StepVal = llvm::ConstantFP::get(*TheContext, llvm::APFloat(1.0));
+  if (auto Step = ast->GetStep()) {
+    StepVal = Step->accept(*this);
+    if (!StepVal)
+      return nullptr;
+  }
+  if (StartVal->getType()->isVectorTy() || EndVal->getType()->isVectorTy() || StepVal->getType()->isVectorTy())
+    return LogErrorV("Loop bounds must be scalars");
+
+  // Capture every variable and array in scope into the environment.
+  std::vector<llvm::Type *> EnvTypes = {DoubleTy, DoubleTy};
+  std::vector<llvm::Value *> EnvValues = {StartVal, StepVal};
+  std::vector<std::string> Scalars, Arrays;
+  for (auto &[Name, Alloca] : NamedValues) {
+    if (!Alloca)
+      continue;
+    Scalars.push_back(Name);
+    EnvTypes.push_back(Alloca->getAllocatedType());
+    EnvValues.push_back(Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, Name.c_str()));
+  }
+  for (auto &[Name, Array] : NamedArrays) {
+    Arrays.push_back(Name);
+    EnvTypes.push_back(Array.Ptr->getType());
+    EnvTypes.push_back(I64);
+    EnvValues.push_back(Array.Ptr);
+    EnvValues.push_back(Array.Len);
+  }
+  llvm::StructType *EnvTy = llvm::StructType::get(*TheContext, EnvTypes);
+
+  // Outline the body, then pick up where we left off.
+  llvm::Function *Kernel;
+  {
+    llvm::IRBuilderBase::InsertPointGuard Guard(*Builder);
+    auto OuterValues = NamedValues;
+    auto OuterArrays = NamedArrays;
+    Kernel = EmitParallelForKernel(ast, EnvTy, Scalars, Arrays);
+    NamedValues = std::move(OuterValues);
+    NamedArrays = std::move(OuterArrays);
+  }
+  if (!Kernel)
+    return nullptr;
+
+  llvm::AllocaInst *Env = CreateEntryBlockAlloca(TheFunction, "parfor.env", EnvTy);
+  for (unsigned i = 0, e = EnvValues.size(); i != e; ++i)
+    Builder->CreateStore(EnvValues[i], Builder->CreateStructGEP(EnvTy, Env, i));
+
+  // A NaN or negative trip count runs no iterations.
+  llvm::Value *Zero = llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0));
+  llvm::Value *Trip = Builder->CreateFDiv(Builder->CreateFSub(EndVal, StartVal), StepVal, "parfor.trip");
+  Trip = Builder->CreateUnaryIntrinsic(llvm::Intrinsic::ceil, Trip);
+  Trip = Builder->CreateSelect(Builder->CreateFCmpOGT(Trip, Zero), Trip, Zero);
+  Trip = Builder->CreateMinNum(Trip, llvm::ConstantFP::get(*TheContext, llvm::APFloat(0x1p62)));
+  Trip = Builder->CreateFPToSI(Trip, I64, "parfor.trip");
+
+  llvm::FunctionCallee ParallelFor = TheModule->getOrInsertFunction(
+    "ks_parallel_for", DoubleTy, I64, Builder->getPtrTy(), Builder->getPtrTy(), Builder->getInt32Ty());
+  llvm::Value *Result = Builder->CreateCall(ParallelFor, {Trip, Kernel, Env, Builder->getInt32(ast->GetReduceOp())},
+                                            "parfor");
+
+  // Without a reduction parfor, like for, returns 0.0.
+  return ast->GetReduceOp() ? Result : Zero;
+}
+
+/// EmitParallelForKernel - Emit the outlined body of a parfor loop, taking its
+/// captured variables from an environment of type EnvTy.
+llvm::Function *LLVMCodegen::EmitParallelForKernel(ForExprAST *ast, llvm::StructType *EnvTy,
+                                                   const std::vector<std::string> &Scalars,
+                                                   const std::vector<std::string> &Arrays) {
+  llvm::Function *Parent = Builder->GetInsertBlock()->getParent();
+  llvm::Type *DoubleTy = Builder->getDoubleTy();
+  llvm::Type *I64 = Builder->getInt64Ty();
+  llvm::FunctionType *FT = llvm::FunctionType::get(DoubleTy, {I64, I64, Builder->getPtrTy()}, false);
+  llvm::Function *Kernel = llvm::Function::Create(FT, llvm::Function::InternalLinkage,
+                                                  Parent->getName() + ".parfor", *TheModule);
+  llvm::Argument *Lo = Kernel->getArg(0), *Hi = Kernel->getArg(1), *EnvArg = Kernel->getArg(2);
+  Lo->setName("lo");
+  Hi->setName("hi");
+  EnvArg->setName("env");
+
+  Builder->SetInsertPoint(llvm::BasicBlock::Create(*TheContext, "entry", Kernel));
+  Unfinished.insert(Kernel);
+
+  // Unpack the environment.
+  auto LoadField = [&](unsigned i, const llvm::Twine &Name) {
+    return Builder->CreateLoad(EnvTy->getElementType(i), Builder->CreateStructGEP(EnvTy, EnvArg, i), Name);
+  };
+  llvm::Value *StartVal = LoadField(0, "start");
+  llvm::Value *StepVal = LoadField(1, "step");
+  unsigned Field = 2;
+  NamedValues.clear();
+  NamedArrays.clear();
+  for (auto &Name : Scalars) {
+    llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(Kernel, Name, EnvTy->getElementType(Field));
+    Builder->CreateStore(LoadField(Field++, Name), Alloca);
+    NamedValues[Name] = Alloca;
+  }
+  for (auto &Name : Arrays) {
+    llvm::Value *Ptr = LoadField(Field++, Name);
+    NamedArrays[Name] = {Ptr, LoadField(Field++, Name + ".len")};
+  }
+
+  // The loop variable, iteration counter and accumulator.
+  const std::string &VarName = ast->GetVarName();
+  char ReduceOp = ast->GetReduceOp();
+  llvm::AllocaInst *Var = CreateEntryBlockAlloca(Kernel, VarName);
+  llvm::AllocaInst *Counter = CreateEntryBlockAlloca(Kernel, "k", I64);
+  llvm::AllocaInst *Acc = CreateEntryBlockAlloca(Kernel, "acc");
+  NamedValues[VarName] = Var;
+  Builder->CreateStore(Lo, Counter);
+  Builder->CreateStore(llvm::ConstantFP::get(*TheContext, llvm::APFloat(ReduceOp == '*' ? 1.0 : 0.0)), Acc);
+
+  // The runtime never hands out empty chunks, so test at the bottom.
+  llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(*TheContext, "loop", Kernel);
+  Builder->CreateBr(LoopBB);
+  Builder->SetInsertPoint(LoopBB);
+
+  llvm::Value *K = Builder->CreateLoad(I64, Counter, "k");
+  llvm::Value *I = Builder->CreateFMul(Builder->CreateSIToFP(K, DoubleTy), StepVal);
+  Builder->CreateStore(Builder->CreateFAdd(StartVal, I), Var);
+
+  llvm::Value *BodyVal = ast->GetBody()->accept(*this);
+  if (BodyVal && ReduceOp && BodyVal->getType()->isVectorTy())
+    BodyVal = LogErrorV("Reduced parfor body must be a scalar");
+  if (!BodyVal) {
+    Unfinished.erase(Kernel);
+    eraseFunction(Kernel);
+    return nullptr;
+  }
+  if (ReduceOp) {
+    llvm::Value *AccVal = Builder->CreateLoad(DoubleTy, Acc, "acc");
+    AccVal = ReduceOp == '*' ? Builder->CreateFMul(AccVal, BodyVal) : Builder->CreateFAdd(AccVal, BodyVal);
+    Builder->CreateStore(AccVal, Acc);
+  }
+
+  llvm::Value *NextK = Builder->CreateAdd(Builder->CreateLoad(I64, Counter, "k"), Builder->getInt64(1), "nextk");
+  Builder->CreateStore(NextK, Counter);
+  llvm::BasicBlock *AfterBB = llvm::BasicBlock::Create(*TheContext, "afterloop", Kernel);
+  Builder->CreateCondBr(Builder->CreateICmpSLT(NextK, Hi, "loopcond"), LoopBB, AfterBB);
+
+  Builder->SetInsertPoint(AfterBB);
+  Builder->CreateRet(Builder->CreateLoad(DoubleTy, Acc, "acc"));
+  Unfinished.erase(Kernel);
+
+  llvm::verifyFunction(*Kernel);
+  RunFunctionPasses(*Kernel);
+  InferFunctionAttributes(*Kernel);
+  TheFAM->clear(*Kernel, Kernel->getName());
+  return Kernel;
 }
\ No newline at end of file
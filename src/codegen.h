@@ -1,14 +1,20 @@
 #ifndef CODEGEN_H
 #define CODEGEN_H
 
+#include <array>
 #include <map>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <llvm/IR/Value.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/PassManager.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBufferRef.h>
 #include <llvm/Analysis/LoopAnalysisManager.h>
 #include <llvm/Analysis/CGSCCPassManager.h>
 #include <llvm/Passes/StandardInstrumentations.h>
@@ -17,6 +23,8 @@
 #include <llvm/Transforms/Scalar/Reassociate.h>
 #include <llvm/Transforms/Scalar/GVN.h>
 #include <llvm/Transforms/Scalar/SimplifyCFG.h>
+#include <llvm/Transforms/IPO/AlwaysInliner.h>
+#include <llvm/Target/TargetMachine.h>
 
 #include "ast.h"
 
@@ -32,20 +40,54 @@ public:
   virtual llvm::Value* VisitFor(ForExprAST* const ast) = 0;
   virtual llvm::Value* VisitUnary(UnaryExprAST* const ast) = 0;
   virtual llvm::Value* VisitVar(VarExprAST* const ast) = 0;
+  virtual llvm::Value* VisitIndex(IndexExprAST* const ast) = 0;
+  virtual llvm::Value* VisitVector(VectorExprAST* const ast) = 0;
+  virtual llvm::Value* VisitShared(ExprAST* const ast) = 0;
 
-  virtual void NewModule(const llvm::DataLayout &layout, const llvm::StringRef &triple) = 0;
+  virtual void NewModule(llvm::TargetMachine *TM, bool KeepContext = false) = 0;
+  virtual void OptimizeModule() = 0;
+  virtual void InlineOperators(llvm::Module &M) = 0;
+  virtual void RecycleContext() = 0;
   virtual std::unique_ptr<llvm::Module> &getModule() = 0;
   virtual std::unique_ptr<llvm::LLVMContext> &getContext() = 0;
   virtual llvm::Function *getFunction(std::string name) = 0;
+  virtual void eraseFunction(llvm::Function *F) = 0;
+  virtual llvm::Function *redefineFunction(FunctionAST *ast) = 0;
   virtual void addFunctionProto(std::string name, std::unique_ptr<PrototypeAST> proto) = 0;
+  virtual const std::map<std::string, std::unique_ptr<PrototypeAST>> &getFunctionProtos() = 0;
+  virtual llvm::Error LinkBitcode(llvm::MemoryBufferRef Bitcode) = 0;
   virtual ~Codegen() = default;
 };
 
+/// ArrayValue - An array argument, passed as a pointer and an i64 length.
+struct ArrayValue {
+  llvm::Value *Ptr;
+  llvm::Value *Len;
+};
+
+/// ProfileOptions - Profiling done by the generated code, and profile-guided
+/// optimization done by OptimizeModule.
+struct ProfileOptions {
+  enum {
+    None,
+    Generate, // count branches and calls; the program writes Path on exit
+    Use,      // weigh branches and functions by the counts in Path (.profdata)
+  } Mode = None;
+  std::string Path;
+  /// Calls - Count and time the calls of every definition (see ks_profile_enter).
+  bool Calls = false;
+};
+
 class LLVMCodegen: public Codegen {
+  llvm::TargetMachine *TheTargetMachine = nullptr;
   std::unique_ptr<llvm::LLVMContext> TheContext;
   std::unique_ptr<llvm::IRBuilder<>> Builder;
   std::unique_ptr<llvm::Module> TheModule;
   std::unique_ptr<llvm::FunctionPassManager> TheFPM;
+  /// TheVectorizeFPM - Run after TheFPM on functions that take arrays, the
+  /// only ones with memory for the vectorizers to work on.
+  std::unique_ptr<llvm::FunctionPassManager> TheVectorizeFPM;
+  std::unique_ptr<llvm::ModulePassManager> TheMPM;
   std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
   std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
   std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
@@ -53,9 +95,47 @@ class LLVMCodegen: public Codegen {
   std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
   std::unique_ptr<llvm::StandardInstrumentations> TheSI;
   std::map<std::string, llvm::AllocaInst *> NamedValues;
+  std::map<std::string, ArrayValue> NamedArrays;
+  /// LoopIndices - The i64 induction variables of the counted loops being
+  /// generated, by loop variable, with the alloca the variable is bound to;
+  /// a[i] indexes with them directly while i is not shadowed.
+  struct LoopIndex {
+    llvm::AllocaInst *Var;
+    llvm::Value *Index;
+  };
+  std::map<std::string, LoopIndex> LoopIndices;
   std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+  /// Specializations - Clones of a function with some arguments bound to
+  /// constants, keyed by the function and (argument index, bit pattern) pairs.
+  std::map<std::pair<llvm::Function *, std::vector<std::pair<unsigned, uint64_t>>>, llvm::Function *> Specializations;
+  unsigned SpecializedInstructions = 0;
+  /// BinaryOperators, UnaryOperators - The functions of user-defined operators
+  /// of the module used so far, indexed by their character.
+  std::array<llvm::Function *, 256> BinaryOperators = {};
+  std::array<llvm::Function *, 256> UnaryOperators = {};
+  /// Unfinished - Functions whose bodies are still being generated.
+  std::set<llvm::Function *> Unfinished;
+  /// SharedValues - Values of the shared pure expressions of the function
+  /// being generated, with the block they were emitted in and the SharedEpoch
+  /// they hold for.  SharedEpoch moves on whenever a variable is assigned or
+  /// bound in the middle of a block; loops and branches start blocks of their
+  /// own.  PureExprs caches IsPure.
+  struct SharedValue {
+    llvm::BasicBlock *Block;
+    unsigned Epoch;
+    llvm::Value *Value;
+  };
+  std::unordered_map<ExprAST *, SharedValue> SharedValues;
+  std::unordered_map<ExprAST *, bool> PureExprs;
+  unsigned SharedEpoch = 0;
+  bool DebugLogging;
+  ProfileOptions Profile;
 
 public:
+  /// LLVMCodegen - DebugLogging prints the passes run on every function.
+  explicit LLVMCodegen(bool DebugLogging = true, ProfileOptions Profile = {})
+    : DebugLogging(DebugLogging), Profile(std::move(Profile)) {}
+
   llvm::Value* VisitNumber(NumberExprAST* const ast);
   llvm::Value* VisitVariable(VariableExprAST* const ast);
   llvm::Value* VisitBinaryExpr(BinaryExprAST* const ast);
@@ -66,15 +146,42 @@ public:
   llvm::Value* VisitFor(ForExprAST* const ast);
   llvm::Value* VisitUnary(UnaryExprAST* const ast);
   llvm::Value* VisitVar(VarExprAST* const ast);
+  llvm::Value* VisitIndex(IndexExprAST* const ast);
+  llvm::Value* VisitVector(VectorExprAST* const ast);
+  llvm::Value* VisitShared(ExprAST* const ast);
 
-  void NewModule(const llvm::DataLayout &layout, const llvm::StringRef &triple);
+  void NewModule(llvm::TargetMachine *TM, bool KeepContext = false);
+  void OptimizeModule();
+  void InlineOperators(llvm::Module &M);
+  void RecycleContext();
   std::unique_ptr<llvm::Module> &getModule() { return TheModule; }
   std::unique_ptr<llvm::LLVMContext> &getContext() { return TheContext; }
   llvm::Function *getFunction(std::string name);
+  void eraseFunction(llvm::Function *F);
+  llvm::Function *redefineFunction(FunctionAST *ast);
   void addFunctionProto(std::string name, std::unique_ptr<PrototypeAST> proto);
+  void clearFunctionProtos() { FunctionProtos.clear(); }
+  const std::map<std::string, std::unique_ptr<PrototypeAST>> &getFunctionProtos() { return FunctionProtos; }
+  llvm::Error LinkBitcode(llvm::MemoryBufferRef Bitcode);
 
 private:
-  llvm::AllocaInst* CreateEntryBlockAlloca(llvm::Function *TheFunction, const std::string &VarName);
+  llvm::AllocaInst* CreateEntryBlockAlloca(llvm::Function *TheFunction, const std::string &VarName,
+                                           llvm::Type *Ty = nullptr);
+  void EmitMemoCache(llvm::Function *TheFunction);
+  void RunFunctionPasses(llvm::Function &F);
+  llvm::Value *EmitCountedFor(ForExprAST *ast, const ArrayValue &Array, int64_t Start, int64_t Step);
+  llvm::Function *getOperator(bool Binary, char Op);
+  void clearOperators();
+  void EmitProfileHooks(llvm::Function *TheFunction, const std::string &Name);
+  llvm::Value *CreateElementPtr(IndexExprAST *ast);
+  bool IsPure(ExprAST *ast);
+  unsigned GetNativeVectorWidth();
+  llvm::Value *EmitVectorBuiltin(CallExprAST *ast);
+  llvm::Function *Specialize(llvm::Function *Callee, std::vector<llvm::Value *> &Args);
+  llvm::Value *EmitParallelFor(ForExprAST *ast);
+  llvm::Function *EmitParallelForKernel(ForExprAST *ast, llvm::StructType *EnvTy,
+                                        const std::vector<std::string> &Scalars,
+                                        const std::vector<std::string> &Arrays);
 };
 
 #endif
\ No newline at end of file
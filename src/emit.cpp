@@ -0,0 +1,160 @@
+#include <optional>
+#include <vector>
+
+#include <llvm/ADT/ScopeExit.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/CodeGen/ParallelCG.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "emit.h"
+
+const char *GetEmitExtension(EmitKind Kind) {
+  switch (Kind) {
+  case EmitObject:
+    return "o";
+  case EmitAssembly:
+    return "s";
+  case EmitBitcode:
+    return "bc";
+  case EmitIR:
+    return "ll";
+  case EmitShared:
+    return "so";
+  }
+  llvm_unreachable("unknown emit kind");
+}
+
+static llvm::Error MakeError(const llvm::Twine &Message) {
+  return llvm::createStringError(llvm::inconvertibleErrorCode(), Message);
+}
+
+/// EmitToStream - Emit every kind but shared libraries into OS.
+static llvm::Error EmitToStream(llvm::Module &M, llvm::TargetMachine &TM, EmitKind Kind,
+                                llvm::raw_pwrite_stream &OS) {
+  switch (Kind) {
+  case EmitBitcode:
+    llvm::WriteBitcodeToFile(M, OS);
+    return llvm::Error::success();
+  case EmitIR:
+    M.print(OS, nullptr);
+    return llvm::Error::success();
+  case EmitObject:
+  case EmitAssembly: {
+    llvm::legacy::PassManager pass;
+    auto FileType = Kind == EmitObject ? llvm::CodeGenFileType::CGFT_ObjectFile
+                                       : llvm::CodeGenFileType::CGFT_AssemblyFile;
+    if (TM.addPassesToEmitFile(pass, OS, nullptr, FileType))
+      return MakeError("TheTargetMachine can't emit a file of this type");
+    pass.run(M);
+    return llvm::Error::success();
+  }
+  case EmitShared:
+    break;
+  }
+  llvm_unreachable("shared libraries are not emitted to streams");
+}
+
+std::unique_ptr<llvm::TargetMachine> CloneTargetMachine(const llvm::TargetMachine &TM) {
+  return std::unique_ptr<llvm::TargetMachine>(TM.getTarget().createTargetMachine(
+    TM.getTargetTriple().str(), TM.getTargetCPU(), TM.getTargetFeatureString(), TM.Options,
+    TM.getRelocationModel(), TM.getCodeModel(), TM.getOptLevel()));
+}
+
+llvm::Error LinkObjects(llvm::ArrayRef<std::string> Objs, llvm::StringRef Path, bool Shared) {
+  auto CC = llvm::sys::findProgramByName("cc");
+  if (!CC)
+    return MakeError("cannot find cc to link " + Path + ": " + CC.getError().message());
+  std::vector<llvm::StringRef> Args = {*CC, Shared ? "-shared" : "-r", "-nostdlib", "-o", Path};
+  Args.insert(Args.end(), Objs.begin(), Objs.end());
+  if (Shared)
+    Args.push_back("-lm");
+  std::string ErrMsg;
+  int Status = llvm::sys::ExecuteAndWait(*CC, Args, std::nullopt, {}, 0, 0, &ErrMsg);
+  if (Status != 0)
+    return MakeError("linking " + Path + " failed" + (ErrMsg.empty() ? "" : ": " + ErrMsg));
+  return llvm::Error::success();
+}
+
+/// EmitSplit - Generate the machine code of Threads partitions of M in
+/// parallel and link the objects into Path, as a shared library if Shared.
+/// Local symbols stay in the partition of their users, so nothing is exported
+/// that a single object would keep local.
+static llvm::Error EmitSplit(llvm::Module &M, llvm::TargetMachine &TM, unsigned Threads, llvm::StringRef Path,
+                             bool Shared) {
+  std::vector<llvm::SmallVector<char, 0>> Objects(Threads);
+  std::vector<std::unique_ptr<llvm::raw_svector_ostream>> Streams;
+  std::vector<llvm::raw_pwrite_stream *> OSs;
+  for (auto &Obj : Objects) {
+    Streams.push_back(std::make_unique<llvm::raw_svector_ostream>(Obj));
+    OSs.push_back(Streams.back().get());
+  }
+  llvm::splitCodeGen(M, OSs, /*BCOSs=*/{}, [&] { return CloneTargetMachine(TM); },
+                     llvm::CodeGenFileType::CGFT_ObjectFile, /*PreserveLocals=*/true);
+
+  std::vector<std::string> Paths;
+  auto RemoveObjects = llvm::make_scope_exit([&] {
+    for (auto &Obj : Paths)
+      llvm::sys::fs::remove(Obj);
+  });
+  for (auto &Obj : Objects) {
+    // Partitions without a function still make a valid, empty object.
+    llvm::SmallString<128> Temp;
+    int FD;
+    if (auto EC = llvm::sys::fs::createTemporaryFile("kaleidoscope", "o", FD, Temp))
+      return MakeError("cannot create a temporary file: " + EC.message());
+    Paths.push_back(std::string(Temp));
+    llvm::raw_fd_ostream(FD, /*shouldClose=*/true) << llvm::StringRef(Obj.data(), Obj.size());
+  }
+  return LinkObjects(Paths, Path, Shared);
+}
+
+llvm::Error EmitToFile(llvm::Module &M, llvm::TargetMachine &TM, EmitKind Kind, llvm::StringRef Path,
+                       unsigned Threads) {
+  if (Threads > 1 && (Kind == EmitObject || Kind == EmitShared))
+    return EmitSplit(M, TM, Threads, Path, Kind == EmitShared);
+  if (Kind == EmitShared) {
+    llvm::SmallString<128> Obj;
+    if (auto EC = llvm::sys::fs::createTemporaryFile("kaleidoscope", "o", Obj))
+      return MakeError("cannot create a temporary file: " + EC.message());
+    auto RemoveObj = llvm::make_scope_exit([&] { llvm::sys::fs::remove(Obj); });
+    if (auto Err = EmitToFile(M, TM, EmitObject, Obj))
+      return Err;
+    return LinkObjects({std::string(Obj)}, Path, /*Shared=*/true);
+  }
+
+  std::error_code EC;
+  bool Text = Kind == EmitAssembly || Kind == EmitIR;
+  llvm::raw_fd_ostream dest(Path, EC, Text ? llvm::sys::fs::OF_Text : llvm::sys::fs::OF_None);
+  if (EC)
+    return MakeError("Could not open file: " + EC.message());
+  if (auto Err = EmitToStream(M, TM, Kind, dest))
+    return Err;
+  dest.flush();
+  return llvm::Error::success();
+}
+
+llvm::Error EmitToBuffer(llvm::Module &M, llvm::TargetMachine &TM, EmitKind Kind, llvm::SmallVectorImpl<char> &Out,
+                         unsigned Threads) {
+  if (Kind == EmitShared || (Kind == EmitObject && Threads > 1)) {
+    llvm::SmallString<128> Lib;
+    if (auto EC = llvm::sys::fs::createTemporaryFile("kaleidoscope", GetEmitExtension(Kind), Lib))
+      return MakeError("cannot create a temporary file: " + EC.message());
+    auto RemoveLib = llvm::make_scope_exit([&] { llvm::sys::fs::remove(Lib); });
+    if (auto Err = EmitToFile(M, TM, Kind, Lib, Threads))
+      return Err;
+    auto Buf = llvm::MemoryBuffer::getFile(Lib);
+    if (!Buf)
+      return MakeError("cannot read " + Lib + ": " + Buf.getError().message());
+    Out.assign((*Buf)->getBufferStart(), (*Buf)->getBufferEnd());
+    return llvm::Error::success();
+  }
+
+  Out.clear();
+  llvm::raw_svector_ostream OS(Out);
+  return EmitToStream(M, TM, Kind, OS);
+}
\ No newline at end of file
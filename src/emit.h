@@ -0,0 +1,48 @@
+#ifndef EMIT_H
+#define EMIT_H
+
+#include <memory>
+#include <string>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Target/TargetMachine.h>
+
+/// EmitKind - Output formats of a compiled module.
+enum EmitKind {
+  EmitObject,   // relocatable object file
+  EmitAssembly, // target assembly
+  EmitBitcode,  // LLVM bitcode
+  EmitIR,       // textual LLVM IR
+  EmitShared,   // shared library, linked with the system C compiler
+};
+
+/// GetEmitExtension - The usual file extension of Kind, e.g. "o".
+const char *GetEmitExtension(EmitKind Kind);
+
+/// CloneTargetMachine - A new target machine configured like TM, for another
+/// thread; a TargetMachine caches subtargets without locking.
+std::unique_ptr<llvm::TargetMachine> CloneTargetMachine(const llvm::TargetMachine &TM);
+
+/// EmitToBuffer - Emit M for TM as Kind into Out.  Only shared libraries and
+/// objects generated on several threads go through temporary files, since they
+/// need an external linker.
+llvm::Error EmitToBuffer(llvm::Module &M, llvm::TargetMachine &TM, EmitKind Kind, llvm::SmallVectorImpl<char> &Out,
+                         unsigned Threads = 1);
+
+/// EmitToFile - Emit M for TM as Kind into the file Path.  With more than one
+/// of Threads, object files and shared libraries are generated from as many
+/// partitions of M in parallel, and the partition objects are linked into one
+/// in a fixed order, so the output is the same from run to run.
+llvm::Error EmitToFile(llvm::Module &M, llvm::TargetMachine &TM, EmitKind Kind, llvm::StringRef Path,
+                       unsigned Threads = 1);
+
+/// LinkObjects - Link object files with the system C compiler into the shared
+/// library Path, or into one relocatable object if Shared is false.  Runtime
+/// functions are left undefined, to be found in the process that loads the
+/// library or in the program linking the object.
+llvm::Error LinkObjects(llvm::ArrayRef<std::string> Objs, llvm::StringRef Path, bool Shared);
+
+#endif
\ No newline at end of file
@@ -1,11 +1,19 @@
 #include <memory>
+#include <string>
 
 #include "ast.h"
 
+static thread_local std::string *ErrorSink = nullptr;
+
+void SetErrorSink(std::string *Sink) { ErrorSink = Sink; }
+
 // Error handling
 /// LogError* - These are little helper functions for error handling.
 std::unique_ptr<ExprAST> LogError(const char *Str) {
-  fprintf(stderr, "Error: %s\n", Str);
+  if (!ErrorSink)
+    fprintf(stderr, "Error: %s\n", Str);
+  else if (ErrorSink->empty())
+    *ErrorSink = Str;
   return nullptr;
 }
 
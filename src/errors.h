@@ -2,9 +2,14 @@
 #define ERRORS_H
 
 #include <memory>
+#include <string>
 
 #include "ast.h"
 
+/// SetErrorSink - Record errors of the calling thread in Sink instead of
+/// printing them; only the first error is kept.  Pass nullptr to print again.
+void SetErrorSink(std::string *Sink);
+
 std::unique_ptr<ExprAST> LogError(const char *Str);
 std::unique_ptr<PrototypeAST> LogErrorP(const char *Str);
 llvm::Value *LogErrorV(const char *Str);
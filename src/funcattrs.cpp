@@ -0,0 +1,97 @@
+#include <llvm/ADT/StringSwitch.h>
+#include <llvm/Analysis/CFG.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+
+#include "funcattrs.h"
+
+/// LibCallArity - Number of arguments of a known pure libm function, or -1 if
+/// the name is not one of them.  These are treated the way clang treats them
+/// under -fno-math-errno: errno is never observed by Kaleidoscope code.
+static int LibCallArity(llvm::StringRef Name) {
+  return llvm::StringSwitch<int>(Name)
+    .Cases("sin", "cos", "tan", "asin", "acos", "atan", 1)
+    .Cases("sinh", "cosh", "tanh", "exp", "exp2", "log", 1)
+    .Cases("log2", "log10", "sqrt", "cbrt", "fabs", "floor", 1)
+    .Cases("ceil", "trunc", "round", 1)
+    .Cases("atan2", "pow", "fmod", "fmin", "fmax", "hypot", 2)
+    .Default(-1);
+}
+
+void AddLibCallAttributes(llvm::Function &F) {
+  if (LibCallArity(F.getName()) != (int)F.arg_size())
+    return;
+
+  F.setDoesNotAccessMemory();
+  F.setDoesNotThrow();
+  F.addFnAttr(llvm::Attribute::WillReturn);
+  F.addFnAttr(llvm::Attribute::Speculatable);
+}
+
+/// SetFnAttr - Add or remove attribute Kind so that it matches Inferred.
+static bool SetFnAttr(llvm::Function &F, llvm::Attribute::AttrKind Kind, bool Inferred) {
+  if (F.hasFnAttribute(Kind) == Inferred)
+    return false;
+  if (Inferred)
+    F.addFnAttr(Kind);
+  else
+    F.removeFnAttr(Kind);
+  return true;
+}
+
+bool InferFunctionAttributes(llvm::Function &F) {
+  bool ReadNone = true, NoUnwind = true, WillReturn = true, Speculatable = true;
+  bool SelfRecursive = false;
+
+  // A loop may not terminate, so only loop-free functions can be willreturn.
+  llvm::SmallVector<std::pair<const llvm::BasicBlock *, const llvm::BasicBlock *>, 4> BackEdges;
+  llvm::FindFunctionBackedges(F, BackEdges);
+  if (!BackEdges.empty())
+    WillReturn = false;
+
+  for (auto &I : llvm::instructions(F)) {
+    if (auto *CB = llvm::dyn_cast<llvm::CallBase>(&I)) {
+      llvm::Function *Callee = CB->getCalledFunction();
+      if (Callee == &F) {
+        // Optimistically assume the function is pure while analysing its own
+        // recursive calls, but recursion may not terminate.
+        SelfRecursive = true;
+        WillReturn = false;
+        continue;
+      }
+      if (!Callee) {
+        ReadNone = NoUnwind = WillReturn = Speculatable = false;
+        break;
+      }
+      ReadNone &= Callee->doesNotAccessMemory();
+      NoUnwind &= Callee->doesNotThrow();
+      WillReturn &= Callee->willReturn();
+      Speculatable &= Callee->isSpeculatable();
+      continue;
+    }
+
+    // Loads and stores of our own stack slots are invisible to callers.
+    if (I.mayReadOrWriteMemory()) {
+      const llvm::Value *Ptr = llvm::getLoadStorePointerOperand(&I);
+      if (!Ptr || !llvm::isa<llvm::AllocaInst>(llvm::getUnderlyingObject(Ptr)))
+        ReadNone = false;
+    }
+    if (I.mayThrow())
+      NoUnwind = false;
+  }
+  Speculatable &= ReadNone && NoUnwind && WillReturn;
+
+  bool Changed = false;
+  if (ReadNone != F.doesNotAccessMemory()) {
+    if (ReadNone)
+      F.setDoesNotAccessMemory();
+    else
+      F.removeFnAttr(llvm::Attribute::Memory);
+    Changed = true;
+  }
+  Changed |= SetFnAttr(F, llvm::Attribute::NoUnwind, NoUnwind);
+  Changed |= SetFnAttr(F, llvm::Attribute::WillReturn, WillReturn);
+  Changed |= SetFnAttr(F, llvm::Attribute::Speculatable, Speculatable);
+  return Changed && SelfRecursive;
+}
@@ -0,0 +1,17 @@
+#ifndef FUNCATTRS_H
+#define FUNCATTRS_H
+
+#include <llvm/IR/Function.h>
+
+/// AddLibCallAttributes - Mark an extern declaration of a well-known pure C
+/// math function (sin, sqrt, pow, ...) as readnone/nounwind/willreturn/
+/// speculatable.  Other functions are left untouched.
+void AddLibCallAttributes(llvm::Function &F);
+
+/// InferFunctionAttributes - Infer memory(none), nounwind, willreturn and
+/// speculatable for a freshly optimized user function from its body and the
+/// attributes of its callees.  Returns true if F calls itself and the new
+/// attributes may allow its body to be simplified further.
+bool InferFunctionAttributes(llvm::Function &F);
+
+#endif
@@ -1,15 +1,31 @@
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <vector>
 
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/InstIterator.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/Support/SmallVectorMemoryBuffer.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 #include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 
 #include "interpreter.h"
+#include "emit.h"
+#include "errors.h"
+#include "jit.h"
+#include "snapshot.h"
 #include "toks.h"
 
+/// ContextReuse - Expressions evaluated before the module moves to a fresh
+/// LLVMContext, dropping the constants interned by the expressions.
+static const unsigned ContextReuse = 4096;
+
 /// top ::= definition | external | expression | ';'
 void Interpreter::MainLoop() {
   while (true) {
-    fprintf(stderr, "ready> ");
+    if (Verbose)
+      fprintf(stderr, "ready> ");
     switch (TheParser->CurTok) {
     case tok_eof:
       return;
@@ -31,7 +47,11 @@ void Interpreter::MainLoop() {
 
 void Interpreter::HandleDefinition() {
   if (auto FnAST = TheParser->ParseDefinition()) {
-    if (auto *FnIR = FnAST->accept(*TheCodegen)) {
+    auto *Old = TheCodegen->getModule()->getFunction(FnAST->GetProto()->GetName());
+    auto *FnIR = Old && !Old->isDeclaration() ? Redefine(FnAST.get()) : FnAST->accept(*TheCodegen);
+    if (FnIR)
+      RecordDefinition(std::move(FnAST));
+    if (FnIR && Verbose) {
       fprintf(stderr, "Parsed a function definition.\n");
       FnIR->print(llvm::errs());
       fprintf(stderr, "\n");
@@ -45,9 +65,11 @@ void Interpreter::HandleDefinition() {
 void Interpreter::HandleExtern() {
   if (auto ProtoAST = TheParser->ParseExtern()) {
     if (auto *ProtoIR = ProtoAST->accept(*TheCodegen)) {
-      fprintf(stderr, "Parsed an extern\n");
-      ProtoIR->print(llvm::errs());
-      fprintf(stderr, "\n");
+      if (Verbose) {
+        fprintf(stderr, "Parsed an extern\n");
+        ProtoIR->print(llvm::errs());
+        fprintf(stderr, "\n");
+      }
       TheCodegen->addFunctionProto(ProtoAST->GetName(), std::move(ProtoAST));
     }
   } else {
@@ -59,13 +81,395 @@ void Interpreter::HandleExtern() {
 void Interpreter::HandleTopLevelExpression() {
   // Evaluate a top-level expression into an anonymous function.
   if (auto FnAST = TheParser->ParseTopLevelExpr()) {
-    if (auto *FnIR = FnAST->accept(*TheCodegen)) {
+    auto *FnIR = FnAST->accept(*TheCodegen);
+    if (FnIR && Verbose) {
       fprintf(stderr, "Parsed a top-level expression.\n");
       FnIR->print(llvm::errs());
       fprintf(stderr, "\n");
     }
+    if (FnIR && TheJIT)
+      Evaluate(FnIR);
   } else {
     // Skip token for error recovery.
     TheParser->getNextToken();
   }
+}
+
+/// RecordDefinition - Keep the AST of a definition and note whom it calls.
+void Interpreter::RecordDefinition(std::unique_ptr<FunctionAST> FnAST) {
+  std::string Name = FnAST->GetProto()->GetName();
+  for (auto &[Callee, Names] : Callers)
+    Names.erase(Name);
+  std::set<std::string> Callees;
+  CollectCallees(FnAST->GetBody(), Callees);
+  for (auto &Callee : Callees)
+    Callers[Callee].insert(Name);
+  Definitions[Name] = std::move(FnAST);
+}
+
+/// WithInternalHelpers - Roots and the internal functions and globals they
+/// refer to, such as parfor kernels, specializations and memo caches, which
+/// have to be compiled along with them.  The initializers of globals count,
+/// such as the name a profile site points to.
+static std::set<const llvm::GlobalValue *> WithInternalHelpers(llvm::ArrayRef<const llvm::GlobalValue *> Roots) {
+  std::set<const llvm::GlobalValue *> Result(Roots.begin(), Roots.end());
+  std::vector<const llvm::Constant *> Worklist(Roots.begin(), Roots.end());
+  auto Visit = [&](const llvm::Value *V) {
+    if (auto *GV = llvm::dyn_cast<llvm::GlobalValue>(V)) {
+      if (GV->hasLocalLinkage() && Result.insert(GV).second)
+        Worklist.push_back(GV);
+    } else if (llvm::isa<llvm::ConstantExpr>(V) || llvm::isa<llvm::ConstantAggregate>(V)) {
+      Worklist.push_back(llvm::cast<llvm::Constant>(V));
+    }
+  };
+  while (!Worklist.empty()) {
+    const llvm::Constant *C = Worklist.back();
+    Worklist.pop_back();
+    if (auto *F = llvm::dyn_cast<llvm::Function>(C)) {
+      for (auto &I : llvm::instructions(*F))
+        for (auto &Op : I.operands())
+          Visit(Op);
+    } else if (auto *Var = llvm::dyn_cast<llvm::GlobalVariable>(C)) {
+      if (Var->hasInitializer())
+        Visit(Var->getInitializer());
+    } else if (!llvm::isa<llvm::GlobalValue>(C)) {
+      for (auto &Op : C->operands())
+        Visit(Op);
+    }
+  }
+  return Result;
+}
+
+/// InlinedOperators - The operators defined in the module that the functions
+/// of Keep call, directly or through each other, and that are not in Keep.
+/// They are always inlined, so compiling Keep needs their bodies.
+static std::vector<llvm::Function *> InlinedOperators(const std::set<const llvm::GlobalValue *> &Keep) {
+  std::vector<llvm::Function *> Result;
+  std::set<const llvm::Function *> Seen;
+  std::vector<const llvm::Function *> Worklist;
+  for (auto *GV : Keep)
+    if (auto *F = llvm::dyn_cast<llvm::Function>(GV))
+      Worklist.push_back(F);
+  while (!Worklist.empty()) {
+    const llvm::Function *F = Worklist.back();
+    Worklist.pop_back();
+    for (auto &I : llvm::instructions(*F)) {
+      auto *Call = llvm::dyn_cast<llvm::CallBase>(&I);
+      llvm::Function *Callee = Call ? Call->getCalledFunction() : nullptr;
+      if (!Callee || Callee->isDeclaration() || !Callee->hasFnAttribute(llvm::Attribute::AlwaysInline) ||
+          Keep.count(Callee) || !Seen.insert(Callee).second)
+        continue;
+      Result.push_back(Callee);
+      Worklist.push_back(Callee);
+    }
+  }
+  return Result;
+}
+
+/// Redefine - Replace the definition of a function already defined.  Calls
+/// to it keep working through the new definition, but callers that depend on
+/// the body of the old one are generated again from their AST, and so on
+/// transitively: callers holding a specialized clone of it, and all callers
+/// if the attributes inferred from its body changed, since they were
+/// optimized on the strength of them.  The JIT code of callers that inlined
+/// an operator is compiled again as well.  Returns the new function.
+llvm::Function *Interpreter::Redefine(FunctionAST *FnAST) {
+  std::string Name = FnAST->GetProto()->GetName();
+  if (FixedDefinitions.count(Name)) {
+    LogError(("cannot redefine " + Name + ", its machine code cannot be replaced").c_str());
+    return nullptr;
+  }
+
+  auto &M = *TheCodegen->getModule();
+  llvm::Function *Result = nullptr;
+  std::vector<std::pair<std::string, FunctionAST *>> Worklist = {{Name, FnAST}};
+  // Mutually recursive callers could otherwise keep each other going.
+  std::map<std::string, unsigned> Rounds;
+  // Only the JIT code inlines operators; the module keeps calling them.  An
+  // operator is also inlined into the callers of the operators calling it.
+  auto Reinline = [&](const std::string &Op) {
+    std::vector<std::string> Ops = {Op};
+    std::set<std::string> Seen = {Op};
+    while (!Ops.empty()) {
+      std::string Current = Ops.back();
+      Ops.pop_back();
+      for (auto &Caller : Callers[Current]) {
+        if (!Seen.insert(Caller).second || !JITDefinitions.count(Caller))
+          continue;
+        if (FixedDefinitions.count(Caller)) {
+          LogError(("cannot update " + Caller + " for the new " + Op + "; define it again").c_str());
+          continue;
+        }
+        StaleDefinitions.insert(Caller);
+        if (llvm::Function *CallerF = M.getFunction(Caller);
+            CallerF && CallerF->hasFnAttribute(llvm::Attribute::AlwaysInline))
+          Ops.push_back(Caller);
+      }
+    }
+  };
+  while (!Worklist.empty()) {
+    auto [Current, AST] = Worklist.back();
+    Worklist.pop_back();
+    llvm::Function *Old = M.getFunction(Current);
+    if (!Old || Old->isDeclaration())
+      continue;
+    llvm::AttributeSet OldAttrs = Old->getAttributes().getFnAttrs();
+    bool WasInlined = Old->hasFnAttribute(llvm::Attribute::AlwaysInline);
+    llvm::Function *New = TheCodegen->redefineFunction(AST);
+    if (!Result) {
+      if (!New)
+        return nullptr;
+      Result = New;
+    }
+    if (!New)
+      continue;
+    if (JITDefinitions.count(Current))
+      StaleDefinitions.insert(Current);
+    if (WasInlined)
+      Reinline(Current);
+
+    bool AttrsChanged = New->getAttributes().getFnAttrs() != OldAttrs;
+    std::string SpecPrefix = Current + ".spec";
+    for (auto &Caller : Callers[Current]) {
+      llvm::Function *CallerF = M.getFunction(Caller);
+      if (Caller == Current || !CallerF || CallerF->isDeclaration())
+        continue;
+      bool Depends = AttrsChanged;
+      for (auto *GV : WithInternalHelpers({CallerF}))
+        Depends |= GV->getName().starts_with(SpecPrefix);
+      if (!Depends)
+        continue;
+      if (++Rounds[Caller] > 2) {
+        LogError(("cannot update " + Caller + " for the new " + Current +
+                  ", its callees keep changing; define it again").c_str());
+        continue;
+      }
+      auto Def = Definitions.find(Caller);
+      if (Def == Definitions.end() || FixedDefinitions.count(Caller)) {
+        LogError(("cannot update " + Caller + " for the new " + Current + "; define it again").c_str());
+        continue;
+      }
+      Worklist.push_back({Caller, Def->second.get()});
+    }
+  }
+  return Result;
+}
+
+llvm::Error Interpreter::EnableEvaluation(KaleidoscopeJIT &JIT) {
+  auto JD = JIT.CreateDylib();
+  if (!JD)
+    return JD.takeError();
+  TheJIT = &JIT;
+  DefinitionsJD = &*JD;
+  return llvm::Error::success();
+}
+
+/// AddGlobalVariables - Add the visible global variables that the functions
+/// of Keep refer to and that are not in the JIT yet, such as profile sites, to
+/// DefinitionsJD in an object of their own.  Every copy of a function compiled
+/// later, in any JITDylib, then uses the same variables, and none of them goes
+/// away with a dylib.
+llvm::Error Interpreter::AddGlobalVariables(const std::set<const llvm::GlobalValue *> &Keep) {
+  std::set<const llvm::GlobalValue *> Vars;
+  for (auto *GV : Keep)
+    if (auto *F = llvm::dyn_cast<llvm::Function>(GV))
+      for (auto &I : llvm::instructions(*F))
+        for (auto &Op : I.operands())
+          if (auto *Var = llvm::dyn_cast<llvm::GlobalVariable>(Op);
+              Var && Var->hasInitializer() && !Var->hasLocalLinkage() && !JITVariables.count(Var->getName().str()))
+            Vars.insert(Var);
+  if (Vars.empty())
+    return llvm::Error::success();
+
+  auto VarsKeep = WithInternalHelpers(std::vector<const llvm::GlobalValue *>(Vars.begin(), Vars.end()));
+  llvm::ValueToValueMapTy VMap;
+  auto M = llvm::CloneModule(*TheCodegen->getModule(), VMap,
+                             [&](const llvm::GlobalValue *GV) { return VarsKeep.count(GV) != 0; });
+  llvm::SmallVector<char, 0> Obj;
+  if (auto Err = EmitToBuffer(*M, *TheTargetMachine, EmitObject, Obj))
+    return Err;
+  auto Buffer = std::make_unique<llvm::SmallVectorMemoryBuffer>(std::move(Obj), (*Vars.begin())->getName(),
+                                                                /*RequiresNullTerminator=*/false);
+  if (auto Err = TheJIT->AddObject(*DefinitionsJD, std::move(Buffer)))
+    return Err;
+  for (auto *Var : Vars)
+    JITVariables.insert(Var->getName().str());
+  return llvm::Error::success();
+}
+
+/// AddToJIT - Compile Roots, with the internal functions they need, in a
+/// module of their own and add the code to JD.  Everything else in the module
+/// is only declared, except for the operators they call, which are inlined as
+/// OptimizeModule would.  WithStubs, each root is compiled under a versioned
+/// name and called through a stub, which a redefinition points at its new
+/// code.
+llvm::Error Interpreter::AddToJIT(llvm::ArrayRef<llvm::Function *> Roots, llvm::orc::JITDylib &JD,
+                                  bool WithStubs) {
+  auto Keep = WithInternalHelpers(std::vector<const llvm::GlobalValue *>(Roots.begin(), Roots.end()));
+  auto Operators = InlinedOperators(Keep);
+  for (auto *GV : WithInternalHelpers(std::vector<const llvm::GlobalValue *>(Operators.begin(), Operators.end())))
+    Keep.insert(GV);
+  if (auto Err = AddGlobalVariables(Keep))
+    return Err;
+  llvm::ValueToValueMapTy VMap;
+  auto M = llvm::CloneModule(*TheCodegen->getModule(), VMap,
+                             [&](const llvm::GlobalValue *GV) { return Keep.count(GV) != 0; });
+  // The operators' own code is in the JIT already; their bodies are only here
+  // to be inlined.
+  for (llvm::Function *Op : Operators)
+    M->getFunction(Op->getName())->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+  TheCodegen->InlineOperators(*M);
+
+  std::vector<std::pair<std::string, std::string>> Impls;
+  if (WithStubs) {
+    for (llvm::Function *Root : Roots) {
+      std::string Name = Root->getName().str();
+      llvm::Function *Impl = M->getFunction(Name);
+      Impl->setName(Name + ".v" + std::to_string(NextVersion++));
+      // Other functions call the stub; recursive calls stay direct.
+      auto *Stub = llvm::Function::Create(Impl->getFunctionType(), llvm::Function::ExternalLinkage, Name, *M);
+      Stub->copyAttributesFrom(Impl);
+      Impl->replaceUsesWithIf(Stub, [&](llvm::Use &U) {
+        auto *I = llvm::dyn_cast<llvm::Instruction>(U.getUser());
+        return !I || I->getFunction() != Impl;
+      });
+      Impls.push_back({Name, Impl->getName().str()});
+    }
+  }
+
+  llvm::SmallVector<char, 0> Obj;
+  if (auto Err = EmitToBuffer(*M, *TheTargetMachine, EmitObject, Obj))
+    return Err;
+  auto Buffer = std::make_unique<llvm::SmallVectorMemoryBuffer>(std::move(Obj), Roots.front()->getName(),
+                                                                /*RequiresNullTerminator=*/false);
+  if (WithStubs)
+    return TheJIT->AddObjectWithStubs(JD, std::move(Buffer), Impls);
+  return TheJIT->AddObject(JD, std::move(Buffer));
+}
+
+/// Evaluate - Run the top-level expression F, then delete it from the module.
+void Interpreter::Evaluate(llvm::Function *F) {
+  auto Report = [](llvm::Error Err) { fprintf(stderr, "Error: %s\n", llvm::toString(std::move(Err)).c_str()); };
+  auto &M = *TheCodegen->getModule();
+
+  // Definitions made or redefined since the last expression join the
+  // long-lived JITDylib.  They are recorded only once their code is linked:
+  // until then they stay pending and the next expression tries again.
+  std::vector<llvm::Function *> NewDefinitions;
+  for (auto &G : M)
+    if (&G != F && !G.isDeclaration() && !G.hasLocalLinkage() &&
+        (!JITDefinitions.count(G.getName().str()) || StaleDefinitions.count(G.getName().str())))
+      NewDefinitions.push_back(&G);
+  bool WithStubs = TheJIT->HasStubs();
+  llvm::Error Err =
+    NewDefinitions.empty() ? llvm::Error::success() : AddToJIT(NewDefinitions, *DefinitionsJD, WithStubs);
+  if (!Err) {
+    for (llvm::Function *G : NewDefinitions) {
+      JITDefinitions.insert(G->getName().str());
+      if (!WithStubs)
+        FixedDefinitions.insert(G->getName().str());
+    }
+    StaleDefinitions.clear();
+  }
+
+  // The expression gets a JITDylib of its own, freed as soon as it has run.
+  if (!Err) {
+    if (auto JD = TheJIT->CreateDylib(DefinitionsJD)) {
+      Err = AddToJIT({F}, *JD, /*WithStubs=*/false);
+      if (!Err) {
+        if (auto Addr = TheJIT->Lookup(*JD, F->getName())) {
+          double Result = reinterpret_cast<double (*)()>(*Addr)();
+          fprintf(stderr, "Evaluated to %f\n", Result);
+        } else {
+          Err = Addr.takeError();
+        }
+      }
+      if (auto RemoveErr = TheJIT->RemoveDylib(*JD))
+        Err = llvm::joinErrors(std::move(Err), std::move(RemoveErr));
+    } else {
+      Err = JD.takeError();
+    }
+  }
+  if (Err)
+    Report(std::move(Err));
+
+  size_t Instructions = 0;
+  for (auto &G : M)
+    Instructions += G.getInstructionCount();
+  PeakFunctions = std::max(PeakFunctions, M.size());
+  PeakInstructions = std::max(PeakInstructions, Instructions);
+
+  TheCodegen->eraseFunction(F);
+  if (++Evaluated % ContextReuse == 0)
+    TheCodegen->RecycleContext();
+}
+
+void Interpreter::PrintStats() {
+  auto &M = *TheCodegen->getModule();
+  size_t Instructions = 0;
+  for (auto &G : M)
+    Instructions += G.getInstructionCount();
+  fprintf(stderr, "%u expressions evaluated; module: %zu functions, %zu instructions (peak %zu, %zu)\n",
+          Evaluated, M.size(), Instructions, PeakFunctions, PeakInstructions);
+}
+
+/// GetTargetString - Identifies the code a target machine generates.
+static std::string GetTargetString(llvm::TargetMachine &TM) {
+  return TM.getTargetTriple().str() + " " + TM.getTargetCPU().str() + " " + TM.getTargetFeatureString().str();
+}
+
+llvm::Error Interpreter::SaveSnapshot(llvm::StringRef Path) {
+  auto &M = *TheCodegen->getModule();
+  Snapshot S;
+  S.Precedences = TheParser->GetBinopPrecedences();
+  for (auto &[Name, Proto] : TheCodegen->getFunctionProtos())
+    if (Name != "__anon_expr")
+      S.Protos.push_back(std::make_unique<PrototypeAST>(*Proto));
+
+  llvm::SmallVector<char, 0> Bitcode;
+  llvm::raw_svector_ostream OS(Bitcode);
+  llvm::WriteBitcodeToFile(M, OS);
+  S.Bitcode = llvm::StringRef(Bitcode.data(), Bitcode.size());
+
+  // Code generation changes the IR, so compile a copy.
+  auto Copy = llvm::CloneModule(M);
+  llvm::SmallVector<char, 0> Obj;
+  if (auto Err = EmitToBuffer(*Copy, *TheTargetMachine, EmitObject, Obj))
+    return Err;
+  S.Object = llvm::StringRef(Obj.data(), Obj.size());
+  std::string Target = GetTargetString(*TheTargetMachine);
+  S.Target = Target;
+
+  return WriteSnapshot(Path, S);
+}
+
+llvm::Error Interpreter::LoadSnapshot(llvm::StringRef Path) {
+  auto S = ReadSnapshot(Path);
+  if (!S)
+    return S.takeError();
+
+  for (auto &[Op, Prec] : S->Precedences)
+    TheParser->AddBinop(Op, Prec);
+  for (auto &Proto : S->Protos) {
+    std::string Name = Proto->GetName();
+    TheCodegen->addFunctionProto(Name, std::move(Proto));
+  }
+  if (auto Err = TheCodegen->LinkBitcode(llvm::MemoryBufferRef(S->Bitcode, Path)))
+    return Err;
+
+  if (!TheJIT || S->Object.empty() || S->Target != GetTargetString(*TheTargetMachine))
+    return llvm::Error::success();
+
+  // The JIT links the object lazily, after the mapping is gone.
+  if (auto Err = TheJIT->AddObject(*DefinitionsJD, llvm::MemoryBuffer::getMemBufferCopy(S->Object, Path)))
+    return Err;
+  for (auto &F : *TheCodegen->getModule())
+    if (!F.isDeclaration() && !F.hasLocalLinkage()) {
+      JITDefinitions.insert(F.getName().str());
+      FixedDefinitions.insert(F.getName().str());
+    }
+  for (auto &Var : TheCodegen->getModule()->globals())
+    if (Var.hasInitializer() && !Var.hasLocalLinkage())
+      JITVariables.insert(Var.getName().str());
+  return llvm::Error::success();
 }
\ No newline at end of file
@@ -1,21 +1,70 @@
 #ifndef INTERPRETER_H
 #define INTERPRETER_H
 
+#include <map>
 #include <memory>
+#include <set>
+#include <string>
 
 #include "parser.h"
 #include "codegen.h"
 
+class KaleidoscopeJIT;
+namespace llvm::orc {
+class JITDylib;
+}
+
 class Interpreter {
   std::unique_ptr<Parser> TheParser;
   std::unique_ptr<Codegen> TheCodegen;
+  llvm::TargetMachine *TheTargetMachine;
+  bool Verbose;
+
+  // The definitions read so far and the functions calling each name, to
+  // generate the callers of a redefined function again.
+  std::map<std::string, std::unique_ptr<FunctionAST>> Definitions;
+  std::map<std::string, std::set<std::string>> Callers;
+
+  // Evaluation of top-level expressions, see EnableEvaluation.
+  KaleidoscopeJIT *TheJIT = nullptr;
+  llvm::orc::JITDylib *DefinitionsJD = nullptr;
+  std::set<std::string> JITDefinitions;
+  // JIT definitions linked without a stub, which cannot be replaced: those
+  // restored from snapshot machine code, or all if the target has no stubs.
+  std::set<std::string> FixedDefinitions;
+  // Redefined since they were added to the JIT.
+  std::set<std::string> StaleDefinitions;
+  // Visible global variables defined in DefinitionsJD, see AddGlobalVariables.
+  std::set<std::string> JITVariables;
+  unsigned NextVersion = 0;
+  unsigned Evaluated = 0;
+  size_t PeakFunctions = 0;
+  size_t PeakInstructions = 0;
 
 public:
-  Interpreter(std::unique_ptr<Parser> parser, std::unique_ptr<Codegen> codegen, llvm::DataLayout layout, llvm::StringRef triple) : TheParser(std::move(parser)) {
+  Interpreter(std::unique_ptr<Parser> parser, std::unique_ptr<Codegen> codegen, llvm::TargetMachine *TM,
+              bool verbose = true) : TheParser(std::move(parser)), TheTargetMachine(TM), Verbose(verbose) {
     TheCodegen = std::move(codegen);
-    TheCodegen->NewModule(layout, triple);
+    TheCodegen->NewModule(TM);
   };
 
+  /// EnableEvaluation - Run top-level expressions in JIT as they are read,
+  /// instead of keeping them in the module.  Each expression is compiled into
+  /// a short-lived module and freed after it ran; definitions stay in the
+  /// module and are added to the JIT as expressions need them.  The target
+  /// machine must generate code for the host.
+  llvm::Error EnableEvaluation(KaleidoscopeJIT &JIT);
+  /// PrintStats - Print how many expressions were evaluated and the size of
+  /// the module.
+  void PrintStats();
+  /// SaveSnapshot - Save the operators, prototypes and definitions read so
+  /// far, with their machine code for the target machine, to Path.
+  llvm::Error SaveSnapshot(llvm::StringRef Path);
+  /// LoadSnapshot - Restore the state saved by SaveSnapshot.  If evaluation
+  /// is enabled, the saved machine code is used when it was made for the same
+  /// target, instead of compiling the definitions again.
+  llvm::Error LoadSnapshot(llvm::StringRef Path);
+
   // Starts an interpreter
   void MainLoop();
   Parser *GetParser() { return TheParser.get(); }
@@ -25,6 +74,11 @@ private:
   void HandleDefinition();
   void HandleExtern();
   void HandleTopLevelExpression();
+  void RecordDefinition(std::unique_ptr<FunctionAST> FnAST);
+  llvm::Function *Redefine(FunctionAST *FnAST);
+  void Evaluate(llvm::Function *F);
+  llvm::Error AddGlobalVariables(const std::set<const llvm::GlobalValue *> &Keep);
+  llvm::Error AddToJIT(llvm::ArrayRef<llvm::Function *> Roots, llvm::orc::JITDylib &JD, bool WithStubs);
 };
 
 #endif
\ No newline at end of file
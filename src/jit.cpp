@@ -0,0 +1,192 @@
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/Object/SymbolSize.h>
+
+#include "jit.h"
+#include "runtime.h"
+
+/// GetSourceName - The Kaleidoscope name of a JIT symbol: the prototype it
+/// came from and what the compiler derived from it.
+static std::string GetSourceName(llvm::StringRef Symbol) {
+  auto [Base, Suffixes] = Symbol.split('.');
+  std::string Name = Base == "__anon_expr" || Base == "__eval" ? "<top-level expression>" : Base.str();
+  while (!Suffixes.empty()) {
+    auto [Suffix, Rest] = Suffixes.split('.');
+    if (Suffix.starts_with("spec"))
+      Name += " [specialized]";
+    else if (Suffix.starts_with("parfor"))
+      Name += " [parfor body]";
+    Suffixes = Rest;
+  }
+  return Name;
+}
+
+namespace {
+
+/// PerfMapListener - Appends the functions of every loaded object to
+/// /tmp/perf-<pid>.map, which perf reads to name samples in JIT code.
+class PerfMapListener : public llvm::JITEventListener {
+  std::mutex Mutex;
+  FILE *Map;
+
+public:
+  PerfMapListener() : Map(fopen(("/tmp/perf-" + std::to_string(getpid()) + ".map").c_str(), "a")) {}
+  ~PerfMapListener() override {
+    if (Map)
+      fclose(Map);
+  }
+
+  void notifyObjectLoaded(ObjectKey K, const llvm::object::ObjectFile &Obj,
+                          const llvm::RuntimeDyld::LoadedObjectInfo &L) override {
+    if (!Map)
+      return;
+    // The object for debuggers carries the load addresses.
+    llvm::object::OwningBinary<llvm::object::ObjectFile> DebugObj = L.getObjectForDebug(Obj);
+    if (!DebugObj.getBinary())
+      return;
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (auto &[Sym, Size] : llvm::object::computeSymbolSizes(*DebugObj.getBinary())) {
+      auto Type = Sym.getType();
+      auto Name = Sym.getName();
+      auto Addr = Sym.getAddress();
+      if (!Type || !Name || !Addr || *Type != llvm::object::SymbolRef::ST_Function || !Size) {
+        llvm::consumeError(Type.takeError());
+        llvm::consumeError(Name.takeError());
+        llvm::consumeError(Addr.takeError());
+        continue;
+      }
+      fprintf(Map, "%llx %llx %s\n", (unsigned long long)*Addr, (unsigned long long)Size,
+              GetSourceName(*Name).c_str());
+    }
+    fflush(Map);
+  }
+};
+
+} // end anonymous namespace
+
+llvm::Expected<std::unique_ptr<KaleidoscopeJIT>> KaleidoscopeJIT::Create(JITListeners Listeners) {
+  llvm::orc::LLJITBuilder Builder;
+  std::unique_ptr<llvm::JITEventListener> PerfMap;
+  if (Listeners.GDB || Listeners.Perf) {
+    std::vector<llvm::JITEventListener *> Registered;
+    if (Listeners.GDB)
+      Registered.push_back(llvm::JITEventListener::createGDBRegistrationListener());
+    if (Listeners.Perf) {
+      PerfMap = std::make_unique<PerfMapListener>();
+      Registered.push_back(PerfMap.get());
+      // Null unless LLVM was built with LLVM_USE_PERF.
+      if (auto *JITDump = llvm::JITEventListener::createPerfJITEventListener())
+        Registered.push_back(JITDump);
+    }
+    Builder.setObjectLinkingLayerCreator([Registered](llvm::orc::ExecutionSession &ES, const llvm::Triple &TT) {
+      auto Layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(
+        ES, [] { return std::make_unique<llvm::SectionMemoryManager>(); });
+      for (auto *L : Registered)
+        Layer->registerJITEventListener(*L);
+      return Layer;
+    });
+  }
+
+  auto J = Builder.create();
+  if (!J)
+    return J.takeError();
+
+  // Runtime functions are bound by address, so they resolve even when the
+  // host does not export them; anything else comes from the process.
+  auto &ES = (*J)->getExecutionSession();
+  auto RuntimeJD = ES.createJITDylib("<runtime>");
+  if (!RuntimeJD)
+    return RuntimeJD.takeError();
+
+  auto Flags = llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+  llvm::orc::SymbolMap Runtime;
+  Runtime[(*J)->mangleAndIntern("putchard")] = {llvm::orc::ExecutorAddr::fromPtr(&putchard), Flags};
+  Runtime[(*J)->mangleAndIntern("printd")] = {llvm::orc::ExecutorAddr::fromPtr(&printd), Flags};
+  Runtime[(*J)->mangleAndIntern("ks_parallel_for")] = {llvm::orc::ExecutorAddr::fromPtr(&ks_parallel_for), Flags};
+  Runtime[(*J)->mangleAndIntern("ks_profile_enter")] = {llvm::orc::ExecutorAddr::fromPtr(&ks_profile_enter), Flags};
+  Runtime[(*J)->mangleAndIntern("ks_profile_exit")] = {llvm::orc::ExecutorAddr::fromPtr(&ks_profile_exit), Flags};
+  if (auto Err = RuntimeJD->define(llvm::orc::absoluteSymbols(std::move(Runtime))))
+    return Err;
+
+  auto Process = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+    (*J)->getDataLayout().getGlobalPrefix());
+  if (!Process)
+    return Process.takeError();
+  RuntimeJD->addGenerator(std::move(*Process));
+
+  std::unique_ptr<llvm::orc::IndirectStubsManager> Stubs;
+  if (auto StubsBuilder = llvm::orc::createLocalIndirectStubsManagerBuilder((*J)->getTargetTriple()))
+    Stubs = StubsBuilder();
+
+  return std::unique_ptr<KaleidoscopeJIT>(
+    new KaleidoscopeJIT(std::move(PerfMap), std::move(*J), *RuntimeJD, std::move(Stubs)));
+}
+
+llvm::Expected<llvm::orc::JITDylib &> KaleidoscopeJIT::CreateDylib(llvm::orc::JITDylib *Parent) {
+  auto &ES = TheJIT->getExecutionSession();
+  auto JD = ES.createJITDylib("unit." + std::to_string(NextDylibId++));
+  if (!JD)
+    return JD.takeError();
+  if (Parent)
+    JD->addToLinkOrder(*Parent);
+  JD->addToLinkOrder(*RuntimeJD);
+  return *JD;
+}
+
+llvm::Error KaleidoscopeJIT::AddObject(llvm::orc::JITDylib &JD, std::unique_ptr<llvm::MemoryBuffer> Obj) {
+  return TheJIT->addObjectFile(JD, std::move(Obj));
+}
+
+llvm::Error KaleidoscopeJIT::AddObjectWithStubs(llvm::orc::JITDylib &JD, std::unique_ptr<llvm::MemoryBuffer> Obj,
+                                                llvm::ArrayRef<std::pair<std::string, std::string>> Impls) {
+  if (!Stubs)
+    return llvm::createStringError(llvm::inconvertibleErrorCode(), "the target has no indirect stubs");
+
+  std::lock_guard<std::mutex> Lock(StubsMutex);
+  auto Flags = llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+  llvm::orc::SymbolMap NewStubs;
+  for (auto &[Name, Impl] : Impls) {
+    if (Stubs->findStub(Name, /*ExportedStubsOnly=*/false).getAddress())
+      continue;
+    // The stub is pointed at the implementation before anything can call it.
+    if (auto Err = Stubs->createStub(Name, llvm::orc::ExecutorAddr(), Flags))
+      return Err;
+    NewStubs[TheJIT->mangleAndIntern(Name)] = {Stubs->findStub(Name, false).getAddress(), Flags};
+  }
+  if (!NewStubs.empty())
+    if (auto Err = JD.define(llvm::orc::absoluteSymbols(std::move(NewStubs))))
+      return Err;
+
+  // A stub created above keeps a null target if linking fails.  Its name
+  // stays defined for the next attempt; the interpreter runs nothing that
+  // calls it until then.
+  if (auto Err = TheJIT->addObjectFile(JD, std::move(Obj)))
+    return Err;
+  for (auto &[Name, Impl] : Impls) {
+    auto Addr = TheJIT->lookup(JD, Impl);
+    if (!Addr)
+      return Addr.takeError();
+    if (auto Err = Stubs->updatePointer(Name, *Addr))
+      return Err;
+  }
+  return llvm::Error::success();
+}
+
+llvm::Expected<void *> KaleidoscopeJIT::Lookup(llvm::orc::JITDylib &JD, llvm::StringRef Name) {
+  auto Addr = TheJIT->lookup(JD, Name);
+  if (!Addr)
+    return Addr.takeError();
+  return Addr->toPtr<void *>();
+}
+
+llvm::Error KaleidoscopeJIT::RemoveDylib(llvm::orc::JITDylib &JD) {
+  return TheJIT->getExecutionSession().removeJITDylib(JD);
+}
\ No newline at end of file
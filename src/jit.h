@@ -0,0 +1,66 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/ExecutionEngine/Orc/IndirectionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+/// JITListeners - Tools to tell about the code the JIT emits, so that they can
+/// name Kaleidoscope functions instead of showing bare addresses.
+struct JITListeners {
+  bool GDB = false;   // register objects through the GDB JIT interface
+  bool Perf = false;  // write /tmp/perf-<pid>.map, and jit-<pid>.dump if LLVM has perf support
+};
+
+/// KaleidoscopeJIT - Links compiled objects into the running process.  Every
+/// compiled unit gets its own JITDylib, so units can define the same names and
+/// be freed independently.  Runtime functions and symbols of the process
+/// (libm etc.) are visible to all of them.  All methods are thread-safe.
+class KaleidoscopeJIT {
+  // The perf map listener must outlive the object layer notifying it.
+  std::unique_ptr<llvm::JITEventListener> PerfMap;
+  std::unique_ptr<llvm::orc::LLJIT> TheJIT;
+  llvm::orc::JITDylib *RuntimeJD;
+  std::atomic<unsigned> NextDylibId{0};
+  // Null if the target has no stub support.
+  std::unique_ptr<llvm::orc::IndirectStubsManager> Stubs;
+  std::mutex StubsMutex;
+
+  KaleidoscopeJIT(std::unique_ptr<llvm::JITEventListener> PerfMap, std::unique_ptr<llvm::orc::LLJIT> J,
+                  llvm::orc::JITDylib &RuntimeJD, std::unique_ptr<llvm::orc::IndirectStubsManager> Stubs)
+    : PerfMap(std::move(PerfMap)), TheJIT(std::move(J)), RuntimeJD(&RuntimeJD), Stubs(std::move(Stubs)) {}
+
+public:
+  /// Create - Make a JIT.  With any of Listeners, objects are linked by
+  /// RuntimeDyld, which the LLVM event listeners work with, instead of JITLink.
+  static llvm::Expected<std::unique_ptr<KaleidoscopeJIT>> Create(JITListeners Listeners = {});
+
+  /// CreateDylib - Make an empty JITDylib that resolves against Parent, if
+  /// given, and then the runtime.
+  llvm::Expected<llvm::orc::JITDylib &> CreateDylib(llvm::orc::JITDylib *Parent = nullptr);
+  llvm::Error AddObject(llvm::orc::JITDylib &JD, std::unique_ptr<llvm::MemoryBuffer> Obj);
+  /// AddObjectWithStubs - Add Obj to JD, and point the stub of each name of
+  /// Impls at the implementation Obj defines for it.  A stub is defined in JD
+  /// under the name the first time; later objects replace the implementation
+  /// without relinking the code that calls it.  If Obj fails to link, the
+  /// stubs keep their old targets and new ones stay unresolved.
+  llvm::Error AddObjectWithStubs(llvm::orc::JITDylib &JD, std::unique_ptr<llvm::MemoryBuffer> Obj,
+                                 llvm::ArrayRef<std::pair<std::string, std::string>> Impls);
+  bool HasStubs() const { return Stubs != nullptr; }
+  llvm::Expected<void *> Lookup(llvm::orc::JITDylib &JD, llvm::StringRef Name);
+  /// LookupExternal - Find Name among the runtime functions and the symbols
+  /// of the process, where every JITDylib resolves what it does not define.
+  llvm::Expected<void *> LookupExternal(llvm::StringRef Name) { return Lookup(*RuntimeJD, Name); }
+  /// RemoveDylib - Free the code and data of a JITDylib.
+  llvm::Error RemoveDylib(llvm::orc::JITDylib &JD);
+  const llvm::DataLayout &GetDataLayout() const { return TheJIT->getDataLayout(); }
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,187 @@
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm/Support/SmallVectorMemoryBuffer.h>
+#include <llvm/Support/TargetSelect.h>
+
+#include "kaleidoscope.h"
+#include "codegen.h"
+#include "emit.h"
+#include "errors.h"
+#include "interpreter.h"
+#include "jit.h"
+
+struct ks_context {
+  std::unique_ptr<KaleidoscopeJIT> JIT;
+  llvm::orc::JITTargetMachineBuilder JTMB;
+  std::mutex Mutex;
+  /// IdleTMs - Target machines not used by a compile.  A TargetMachine caches
+  /// subtargets without locking, so each compile takes one for itself.
+  std::vector<std::unique_ptr<llvm::TargetMachine>> IdleTMs;
+  std::set<ks_module *> Modules;
+
+  ks_context(std::unique_ptr<KaleidoscopeJIT> JIT, llvm::orc::JITTargetMachineBuilder JTMB)
+    : JIT(std::move(JIT)), JTMB(std::move(JTMB)) {}
+};
+
+struct ks_module {
+  ks_context *Ctx;
+  llvm::orc::JITDylib *JD;
+};
+
+static thread_local std::string LastError;
+
+/// Fail - Record the message of Err as the error of this thread.
+static std::nullptr_t Fail(llvm::Error Err) {
+  LastError = llvm::toString(std::move(Err));
+  return nullptr;
+}
+
+static std::unique_ptr<llvm::TargetMachine> AcquireTargetMachine(ks_context *Ctx) {
+  {
+    std::lock_guard<std::mutex> Lock(Ctx->Mutex);
+    if (!Ctx->IdleTMs.empty()) {
+      auto TM = std::move(Ctx->IdleTMs.back());
+      Ctx->IdleTMs.pop_back();
+      return TM;
+    }
+  }
+  auto TM = Ctx->JTMB.createTargetMachine();
+  if (!TM)
+    return Fail(TM.takeError());
+  return std::move(*TM);
+}
+
+static void ReleaseTargetMachine(ks_context *Ctx, std::unique_ptr<llvm::TargetMachine> TM) {
+  std::lock_guard<std::mutex> Lock(Ctx->Mutex);
+  Ctx->IdleTMs.push_back(std::move(TM));
+}
+
+/// Compile - Compile Source for TM into Out as Kind.  Returns false on error.
+static bool Compile(const char *Source, llvm::TargetMachine &TM, EmitKind Kind, llvm::SmallVectorImpl<char> &Out) {
+  // The parser and codegen report through LogError; collect the first error
+  // instead of printing it.
+  LastError.clear();
+  SetErrorSink(&LastError);
+  Interpreter TheInterpreter(std::make_unique<Parser>(std::make_unique<Lexer>(Source)),
+                             std::make_unique<LLVMCodegen>(/*DebugLogging=*/false), &TM, /*verbose=*/false);
+  auto Parser = TheInterpreter.GetParser();
+  Parser->AddStandardBinops();
+  Parser->getNextToken();
+  TheInterpreter.MainLoop();
+  SetErrorSink(nullptr);
+  if (!LastError.empty())
+    return false;
+
+  auto Codegen = TheInterpreter.GetCodegen();
+  Codegen->OptimizeModule();
+  if (auto Err = EmitToBuffer(*Codegen->getModule(), TM, Kind, Out)) {
+    Fail(std::move(Err));
+    return false;
+  }
+  return true;
+}
+
+/// Compile - Compile Source with a target machine of the pool of Ctx.
+static bool Compile(ks_context *Ctx, const char *Source, EmitKind Kind, llvm::SmallVectorImpl<char> &Out) {
+  auto TM = AcquireTargetMachine(Ctx);
+  if (!TM)
+    return false;
+  bool Compiled = Compile(Source, *TM, Kind, Out);
+  ReleaseTargetMachine(Ctx, std::move(TM));
+  return Compiled;
+}
+
+ks_context *ks_context_create(void) {
+  static std::once_flag InitTargets;
+  std::call_once(InitTargets, [] {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+  });
+
+  auto JTMB = llvm::orc::JITTargetMachineBuilder::detectHost();
+  if (!JTMB)
+    return Fail(JTMB.takeError());
+  // Position independent code can be loaded by the JIT and linked into
+  // shared libraries alike.
+  JTMB->setRelocationModel(llvm::Reloc::PIC_);
+  // Profilers and debuggers of the host program are told about the JIT code
+  // on request, since registering objects slows down every compile.
+  JITListeners Listeners;
+  Listeners.Perf = getenv("KS_JIT_PERF") != nullptr;
+  Listeners.GDB = getenv("KS_JIT_GDB") != nullptr;
+  auto JIT = KaleidoscopeJIT::Create(Listeners);
+  if (!JIT)
+    return Fail(JIT.takeError());
+  return new ks_context(std::move(*JIT), std::move(*JTMB));
+}
+
+void ks_context_destroy(ks_context *Ctx) {
+  for (ks_module *M : Ctx->Modules)
+    delete M;
+  delete Ctx;
+}
+
+ks_module *ks_compile(ks_context *Ctx, const char *Source) {
+  llvm::SmallVector<char, 0> Buffer;
+  if (!Compile(Ctx, Source, EmitObject, Buffer))
+    return nullptr;
+  auto Obj = std::make_unique<llvm::SmallVectorMemoryBuffer>(std::move(Buffer), "ks_compile",
+                                                             /*RequiresNullTerminator=*/false);
+
+  auto JD = Ctx->JIT->CreateDylib();
+  if (!JD)
+    return Fail(JD.takeError());
+  if (auto Err = Ctx->JIT->AddObject(*JD, std::move(Obj))) {
+    llvm::consumeError(Ctx->JIT->RemoveDylib(*JD));
+    return Fail(std::move(Err));
+  }
+
+  auto M = new ks_module{Ctx, &*JD};
+  std::lock_guard<std::mutex> Lock(Ctx->Mutex);
+  Ctx->Modules.insert(M);
+  return M;
+}
+
+void *ks_emit(ks_context *Ctx, const char *Source, ks_emit_kind Kind, size_t *Size) {
+  static const EmitKind Kinds[] = {EmitObject, EmitAssembly, EmitBitcode, EmitIR, EmitShared};
+  if (Kind < KS_EMIT_OBJ || Kind > KS_EMIT_SO) {
+    LastError = "unknown emit kind";
+    return nullptr;
+  }
+  llvm::SmallVector<char, 0> Buffer;
+  if (!Compile(Ctx, Source, Kinds[Kind], Buffer))
+    return nullptr;
+  void *Result = malloc(Buffer.size() ? Buffer.size() : 1);
+  memcpy(Result, Buffer.data(), Buffer.size());
+  *Size = Buffer.size();
+  return Result;
+}
+
+void *ks_lookup(ks_module *M, const char *Name) {
+  auto Addr = M->Ctx->JIT->Lookup(*M->JD, Name);
+  if (!Addr)
+    return Fail(Addr.takeError());
+  return *Addr;
+}
+
+void ks_module_destroy(ks_module *M) {
+  ks_context *Ctx = M->Ctx;
+  {
+    std::lock_guard<std::mutex> Lock(Ctx->Mutex);
+    Ctx->Modules.erase(M);
+  }
+  if (auto Err = Ctx->JIT->RemoveDylib(*M->JD))
+    Fail(std::move(Err));
+  delete M;
+}
+
+const char *ks_last_error(void) {
+  return LastError.c_str();
+}
\ No newline at end of file
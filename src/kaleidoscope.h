@@ -0,0 +1,69 @@
+#ifndef KALEIDOSCOPE_H
+#define KALEIDOSCOPE_H
+
+/* Embedding API of libkaleidoscope.
+ *
+ * A context owns a JIT and a pool of target machines for the host.  Source is
+ * compiled into a module whose functions can then be looked up and called:
+ *
+ *   ks_context *Ctx = ks_context_create();
+ *   ks_module *M = ks_compile(Ctx, "def f(x) x * x + 1;");
+ *   double (*F)(double) = (double (*)(double))ks_lookup(M, "f");
+ *
+ * All functions are safe to call concurrently from any number of threads,
+ * including ks_compile on the same context.  Each module is compiled in a
+ * fresh LLVM context, so modules cannot call each other's functions. */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ks_context ks_context;
+typedef struct ks_module ks_module;
+
+/* ks_emit_kind - Output formats of ks_emit. */
+typedef enum {
+  KS_EMIT_OBJ, /* relocatable object file */
+  KS_EMIT_ASM, /* target assembly */
+  KS_EMIT_BC,  /* LLVM bitcode */
+  KS_EMIT_LL,  /* textual LLVM IR */
+  KS_EMIT_SO   /* shared library, linked with cc through temporary files */
+} ks_emit_kind;
+
+/* ks_context_create - Make a context, or return NULL if the host target is not
+ * supported (see ks_last_error). */
+ks_context *ks_context_create(void);
+
+/* ks_context_destroy - Free a context and every module compiled in it. */
+void ks_context_destroy(ks_context *Ctx);
+
+/* ks_compile - Compile a sequence of definitions, externs and top-level
+ * expressions.  The first top-level expression is named "__anon_expr".
+ * Returns NULL on the first error (see ks_last_error). */
+ks_module *ks_compile(ks_context *Ctx, const char *Source);
+
+/* ks_emit - Compile Source for the host like ks_compile, but return the
+ * output as Kind instead of loading it.  The result is a malloc'd buffer of
+ * *Size bytes, to be freed with free(), or NULL on error (see ks_last_error).
+ * Only KS_EMIT_SO touches the file system. */
+void *ks_emit(ks_context *Ctx, const char *Source, ks_emit_kind Kind, size_t *Size);
+
+/* ks_lookup - Return the address of a function of a module, or NULL if it is
+ * not defined.  Arguments and results are doubles; an array argument is a
+ * double pointer followed by an int64_t length. */
+void *ks_lookup(ks_module *M, const char *Name);
+
+/* ks_module_destroy - Free the code of a module.  Its functions must not be
+ * running or called afterwards. */
+void ks_module_destroy(ks_module *M);
+
+/* ks_last_error - Message of the last failed call on this thread. */
+const char *ks_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
\ No newline at end of file
@@ -1,63 +1,254 @@
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <iostream>
 #include <string>
+#include <string_view>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "lexer.h"
 #include "toks.h"
 
+namespace {
+
+/// CharClass - Classes of the characters of the source, as the C locale has
+/// them, so the lexer does not call into the locale for every character.
+enum CharClass : uint8_t {
+  CC_Space = 1, // ' ', '\t', '\n', '\v', '\f', '\r'
+  CC_Alpha = 2,
+  CC_Digit = 4,
+  CC_HexDigit = 8,
+};
+
+constexpr std::array<uint8_t, 256> BuildCharClasses() {
+  std::array<uint8_t, 256> Classes{};
+  for (int C = '\t'; C <= '\r'; ++C)
+    Classes[C] = CC_Space;
+  Classes[' '] = CC_Space;
+  for (int C = 'a'; C <= 'z'; ++C)
+    Classes[C] = Classes[C - 'a' + 'A'] = CC_Alpha;
+  for (int C = '0'; C <= '9'; ++C)
+    Classes[C] = CC_Digit | CC_HexDigit;
+  for (int C = 'a'; C <= 'f'; ++C)
+    Classes[C] = Classes[C - 'a' + 'A'] = CC_Alpha | CC_HexDigit;
+  return Classes;
+}
+
+constexpr std::array<uint8_t, 256> CharClasses = BuildCharClasses();
+
+bool Is(int C, uint8_t Class) { return C != EOF && (CharClasses[C] & Class); }
+
+struct Keyword {
+  std::string_view Name;
+  int Tok;
+  unsigned VecWidth;
+};
+
+constexpr Keyword Keywords[] = {
+  {"def", tok_def, 0},       {"extern", tok_extern, 0}, {"if", tok_if, 0},         {"then", tok_then, 0},
+  {"else", tok_else, 0},     {"for", tok_for, 0},       {"in", tok_in, 0},         {"parfor", tok_parfor, 0},
+  {"reduce", tok_reduce, 0}, {"binary", tok_binary, 0}, {"unary", tok_unary, 0},   {"var", tok_var, 0},
+  {"memo", tok_memo, 0},     {"vec", tok_vec, 0},       {"vec2", tok_vec, 2},      {"vec4", tok_vec, 4},
+  {"vec8", tok_vec, 8},
+};
+
+/// KeywordHash - A perfect hash of the keywords, from their length and their
+/// first and last characters.  S is not empty.
+constexpr unsigned KeywordHash(std::string_view S) {
+  return (S.size() * 2 + (unsigned char)S.front() * 13 + (unsigned char)S.back() * 3) % 32;
+}
+
+/// KeywordSlots - Index into Keywords of the keyword in every hash slot, or -1.
+constexpr std::array<int8_t, 32> BuildKeywordSlots() {
+  std::array<int8_t, 32> Slots{};
+  for (auto &Slot : Slots)
+    Slot = -1;
+  for (unsigned i = 0; i != std::size(Keywords); ++i)
+    Slots[KeywordHash(Keywords[i].Name)] = i;
+  return Slots;
+}
+
+constexpr std::array<int8_t, 32> KeywordSlots = BuildKeywordSlots();
+
+constexpr bool KeywordHashIsPerfect() {
+  for (unsigned i = 0; i != std::size(Keywords); ++i)
+    if (KeywordSlots[KeywordHash(Keywords[i].Name)] != (int8_t)i)
+      return false;
+  return true;
+}
+
+static_assert(KeywordHashIsPerfect(), "keywords collide in KeywordHash; pick other multipliers");
+
+/// FindKeyword - The keyword Name is, or null for an identifier.
+const Keyword *FindKeyword(std::string_view Name) {
+  int Slot = KeywordSlots[KeywordHash(Name)];
+  if (Slot < 0 || Keywords[Slot].Name != Name)
+    return nullptr;
+  return &Keywords[Slot];
+}
+
+/// SkipSpaces - Index of the first character at or after Pos in Buffer that
+/// is not whitespace, or the size of Buffer.
+size_t SkipSpaces(const std::string &Buffer, size_t Pos) {
+  const char *P = Buffer.data() + Pos, *End = Buffer.data() + Buffer.size();
+#ifdef __SSE2__
+  const __m128i Space = _mm_set1_epi8(' '), Tab = _mm_set1_epi8('\t'), Four = _mm_set1_epi8(4);
+  for (; End - P >= 16; P += 16) {
+    __m128i Chars = _mm_loadu_si128(reinterpret_cast<const __m128i *>(P));
+    // '\t'..'\r' are the five characters C with C - '\t' <= 4 unsigned.
+    __m128i Control = _mm_sub_epi8(Chars, Tab);
+    __m128i IsSpace = _mm_or_si128(_mm_cmpeq_epi8(Chars, Space),
+                                   _mm_cmpeq_epi8(_mm_min_epu8(Control, Four), Control));
+    unsigned Mask = ~_mm_movemask_epi8(IsSpace) & 0xFFFF;
+    if (Mask)
+      return P - Buffer.data() + __builtin_ctz(Mask);
+  }
+#endif
+  while (P != End && (CharClasses[(unsigned char)*P] & CC_Space))
+    ++P;
+  return P - Buffer.data();
+}
+
+/// SkipToLineEnd - Index of the first '\n' or '\r' at or after Pos in Buffer,
+/// or the size of Buffer.
+size_t SkipToLineEnd(const std::string &Buffer, size_t Pos) {
+  const char *P = Buffer.data() + Pos, *End = Buffer.data() + Buffer.size();
+#ifdef __SSE2__
+  const __m128i NL = _mm_set1_epi8('\n'), CR = _mm_set1_epi8('\r');
+  for (; End - P >= 16; P += 16) {
+    __m128i Chars = _mm_loadu_si128(reinterpret_cast<const __m128i *>(P));
+    unsigned Mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(Chars, NL), _mm_cmpeq_epi8(Chars, CR)));
+    if (Mask)
+      return P - Buffer.data() + __builtin_ctz(Mask);
+  }
+#endif
+  while (P != End && *P != '\n' && *P != '\r')
+    ++P;
+  return P - Buffer.data();
+}
+
+} // end anonymous namespace
+
+/// ClassAt - The class of Buffer[Pos], or 0 past its end.
+static uint8_t ClassAt(const std::string &Buffer, size_t Pos) {
+  return Pos < Buffer.size() ? CharClasses[(unsigned char)Buffer[Pos]] : 0;
+}
+
+/// SkipExponent - Index past the exponent starting at Pos in Buffer, if there
+/// is one introduced by Marker ('e' or 'p', either case), or Pos.
+static size_t SkipExponent(const std::string &Buffer, size_t Pos, char Marker) {
+  if (Pos == Buffer.size() || (Buffer[Pos] | 0x20) != Marker)
+    return Pos;
+  size_t Digits = Pos + 1;
+  if (Digits < Buffer.size() && (Buffer[Digits] == '+' || Buffer[Digits] == '-'))
+    ++Digits;
+  // Otherwise the letter starts an identifier.
+  if (!(ClassAt(Buffer, Digits) & CC_Digit))
+    return Pos;
+  while (ClassAt(Buffer, Digits) & CC_Digit)
+    ++Digits;
+  return Digits;
+}
+
+/// GetLocation - "line:column" of Buffer[Offset].
+std::string Lexer::GetLocation(size_t Offset) {
+  // Count on from the last location asked for, if it is in the same buffer.
+  if (Offset < Counted.Offset || Buffer.data() != Counted.Buffer)
+    Counted = {Buffer.data(), 0, 0, 0};
+  for (size_t i = Counted.Offset; i != Offset; ++i)
+    if (Buffer[i] == '\n') {
+      ++Counted.Lines;
+      Counted.LineStart = i + 1;
+    }
+  Counted.Offset = Offset;
+  return std::to_string(LinesBefore + Counted.Lines + 1) + ":" + std::to_string(Offset - Counted.LineStart + 1);
+}
+
+/// LexNumber - Scan the number starting at LastChar straight from the buffer:
+///   number ::= [0-9.]+ ([eE] [+-]? [0-9]+)?
+///            | 0[xX] [0-9a-fA-F.]+ ([pP] [+-]? [0-9]+)?
+/// A malformed number, such as 1.2.3, is still one token, with NumError set.
+int Lexer::LexNumber() {
+  size_t Start = Pos - 1, End = Pos;
+  auto IsHexMantissa = [&](size_t i) {
+    return (ClassAt(Buffer, i) & CC_HexDigit) || (i < Buffer.size() && Buffer[i] == '.');
+  };
+  bool Hex = LastChar == '0' && End < Buffer.size() && (Buffer[End] | 0x20) == 'x' && IsHexMantissa(End + 1);
+  if (Hex) {
+    End += 1;
+    while (IsHexMantissa(End))
+      ++End;
+    End = SkipExponent(Buffer, End, 'p');
+  } else {
+    while ((ClassAt(Buffer, End) & CC_Digit) || (End < Buffer.size() && Buffer[End] == '.'))
+      ++End;
+    End = SkipExponent(Buffer, End, 'e');
+  }
+
+  const char *First = Buffer.data() + Start + (Hex ? 2 : 0), *Last = Buffer.data() + End;
+  auto [Ptr, EC] = std::from_chars(First, Last, NumVal, Hex ? std::chars_format::hex : std::chars_format::general);
+  NumError.clear();
+  if (EC == std::errc::result_out_of_range)
+    NumError = GetLocation(Start) + ": number out of range: " + Buffer.substr(Start, End - Start);
+  else if (EC != std::errc() || Ptr != Last)
+    NumError = GetLocation(Start) + ": malformed number: " + Buffer.substr(Start, End - Start);
+  if (!NumError.empty())
+    NumVal = 0;
+
+  Pos = End;
+  LastChar = getchar();
+  return tok_number;
+}
+
+/// getchar - Return the next character of the source, refilling the buffer
+/// from stdin when reading interactively.
+int Lexer::getchar() {
+  if (Pos == Buffer.size()) {
+    LinesBefore += std::count(Buffer.begin(), Buffer.end(), '\n');
+    Buffer.clear();
+    Pos = 0;
+    if (!FromStdin || !std::getline(std::cin, Buffer))
+      return EOF;
+    Buffer += '\n';
+  }
+  return (unsigned char)Buffer[Pos++];
+}
+
 int Lexer::gettok() {
-  static int LastChar = ' ';
+  // LastChar is Buffer[Pos - 1]; skip the rest of a run of whitespace in the
+  // buffer at once.
+  while (Is(LastChar, CC_Space)) {
+    Pos = SkipSpaces(Buffer, Pos);
+    LastChar = getchar();
+  }
 
-  while (isspace(LastChar)) 
+  if (Is(LastChar, CC_Alpha)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
+    // The buffer holds whole lines, so identifiers do not span refills.
+    size_t Start = Pos - 1;
+    while (Pos != Buffer.size() && (CharClasses[(unsigned char)Buffer[Pos]] & (CC_Alpha | CC_Digit)))
+      ++Pos;
+    IdentifierStr.assign(Buffer, Start, Pos - Start);
     LastChar = getchar();
 
-  if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
-    IdentifierStr = LastChar;
-    while (isalnum((LastChar = getchar())))
-      IdentifierStr += LastChar;
-
-    if (IdentifierStr == "def")
-      return tok_def;
-    if (IdentifierStr == "extern")
-      return tok_extern;
-    if (IdentifierStr == "if")
-      return tok_if;
-    if (IdentifierStr == "then")
-      return tok_then;
-    if (IdentifierStr == "else")
-      return tok_else;
-    if (IdentifierStr == "for")
-      return tok_for;
-    if (IdentifierStr == "in")
-      return tok_in;
-    if (IdentifierStr == "binary")
-      return tok_binary;
-    if (IdentifierStr == "unary")
-      return tok_unary;
-    if (IdentifierStr == "var")
-      return tok_var;
-    return tok_identifier;
-  }
-  if (isdigit(LastChar) || LastChar == '.') {   // Number: [0-9.]+
-    std::string NumStr;
-    do {
-      NumStr += LastChar;
-      LastChar = getchar();
-    } while (isdigit(LastChar) || LastChar == '.');
-
-    char *after;
-    NumVal = strtod(NumStr.c_str(), &after);
-    if (strlen(after) != 0) {
-      NumVal = std::numeric_limits<double>::quiet_NaN();
+    if (const Keyword *K = FindKeyword(IdentifierStr)) {
+      VecWidth = K->VecWidth;
+      return K->Tok;
     }
-    return tok_number;
+    return tok_identifier;
   }
+  if (Is(LastChar, CC_Digit) || LastChar == '.')
+    return LexNumber();
   if (LastChar == EOF)
     return tok_eof;
 
   if (LastChar == '#') {
     // Comment until end of line.
-    do
-      LastChar = getchar();
-    while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+    Pos = SkipToLineEnd(Buffer, Pos);
+    LastChar = getchar();
 
     if (LastChar != EOF)
       return gettok();
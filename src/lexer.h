@@ -7,8 +7,30 @@ class Lexer {
 public:
     std::string IdentifierStr;
     double NumVal;
+    std::string NumError; // Why the last number is malformed, with its location; empty if it is not.
+    unsigned VecWidth;  // Lanes of a vecN token, 0 for the native width.
+
+    /// Lexer - Read source from stdin a line at a time.
+    Lexer() = default;
+    /// Lexer - Read source from a string.
+    explicit Lexer(std::string Source) : Buffer(std::move(Source)), FromStdin(false) {}
 
     int gettok();
+
+private:
+    int LastChar = ' ';
+    std::string Buffer;
+    size_t Pos = 0;
+    bool FromStdin = true;
+    unsigned LinesBefore = 0; // Lines read from stdin before Buffer.
+    struct {
+      const char *Buffer;
+      size_t Offset, Lines, LineStart;
+    } Counted = {}; // Lines of Buffer before Offset, for GetLocation.
+
+    int getchar();
+    int LexNumber();
+    std::string GetLocation(size_t Offset);
 };
 
 #endif
\ No newline at end of file
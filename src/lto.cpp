@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <map>
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/Analysis/ModuleSummaryAnalysis.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/LTO/LTO.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/Caching.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Transforms/IPO/Internalize.h>
+
+#include "lto.h"
+#include "codegen.h"
+#include "errors.h"
+#include "interpreter.h"
+#include "memstats.h"
+#include "parallel.h"
+
+static llvm::Error MakeError(const llvm::Twine &Message) {
+  return llvm::createStringError(llvm::inconvertibleErrorCode(), Message);
+}
+
+/// FinishUnit - Optimize the module of Codegen as a whole and write it out.
+static CompiledUnit FinishUnit(llvm::StringRef Name, Codegen &TheCodegen, bool WithSummary) {
+  // Every unit with a top-level expression defines __anon_expr; keep it local
+  // to the unit so that units link together.
+  if (llvm::Function *Expr = TheCodegen.getModule()->getFunction("__anon_expr"))
+    Expr->setLinkage(llvm::GlobalValue::InternalLinkage);
+  TheCodegen.OptimizeModule();
+  ReportMemory(Name + ": optimization");
+  llvm::Module &M = *TheCodegen.getModule();
+  M.setModuleIdentifier(Name);
+
+  CompiledUnit Unit;
+  Unit.Name = Name.str();
+  llvm::raw_svector_ostream OS(Unit.Bitcode);
+  if (WithSummary) {
+    llvm::ModuleSummaryIndex Index = llvm::buildModuleSummaryIndex(M, nullptr, nullptr);
+    llvm::WriteBitcodeToFile(M, OS, /*ShouldPreserveUseListOrder=*/false, &Index);
+  } else {
+    llvm::WriteBitcodeToFile(M, OS);
+  }
+  return Unit;
+}
+
+llvm::Expected<CompiledUnit> CompileUnit(llvm::StringRef Name, std::string Source, llvm::TargetMachine &TM,
+                                         bool WithSummary, const ProfileOptions &Profile, unsigned Threads) {
+  if (Threads != 1) {
+    LLVMCodegen Codegen(/*DebugLogging=*/false, Profile);
+    if (auto Err = GenerateInParallel(Name, std::move(Source), TM, Threads, Profile, Codegen))
+      return MakeError(Name + ": " + llvm::toString(std::move(Err)));
+    ReportMemory(Name + ": IR generation");
+    return FinishUnit(Name, Codegen, WithSummary);
+  }
+
+  std::string Error;
+  SetErrorSink(&Error);
+  Interpreter TheInterpreter(std::make_unique<Parser>(std::make_unique<Lexer>(std::move(Source))),
+                             std::make_unique<LLVMCodegen>(/*DebugLogging=*/false, Profile), &TM, /*verbose=*/false);
+  auto Parser = TheInterpreter.GetParser();
+  Parser->AddStandardBinops();
+  Parser->getNextToken();
+  TheInterpreter.MainLoop();
+  SetErrorSink(nullptr);
+  if (!Error.empty())
+    return MakeError(Name + ": " + Error);
+  // Definitions are generated as they are read, so the two phases are one.
+  ReportMemory(Name + ": parsing and IR generation");
+  return FinishUnit(Name, *TheInterpreter.GetCodegen(), WithSummary);
+}
+
+static llvm::MemoryBufferRef GetBuffer(const CompiledUnit &Unit) {
+  return llvm::MemoryBufferRef(llvm::StringRef(Unit.Bitcode.data(), Unit.Bitcode.size()), Unit.Name);
+}
+
+llvm::Expected<std::unique_ptr<llvm::Module>> LinkUnits(llvm::ArrayRef<CompiledUnit> Units,
+                                                        llvm::LLVMContext &Context) {
+  auto Composite = std::make_unique<llvm::Module>("linked", Context);
+  llvm::Linker L(*Composite);
+  for (auto &Unit : Units) {
+    auto M = llvm::parseBitcodeFile(GetBuffer(Unit), Context);
+    if (!M)
+      return M.takeError();
+    // The first unit decides the data layout and triple.
+    if (Composite->getDataLayout().isDefault())
+      Composite->setDataLayout((*M)->getDataLayout());
+    if (Composite->getTargetTriple().empty())
+      Composite->setTargetTriple((*M)->getTargetTriple());
+    if (L.linkInModule(std::move(*M)))
+      return MakeError("cannot link " + Unit.Name);
+  }
+  return Composite;
+}
+
+void RunFullLTO(llvm::Module &M, llvm::TargetMachine &TM, llvm::ArrayRef<std::string> Exports) {
+  if (!Exports.empty())
+    llvm::internalizeModule(M, [&](const llvm::GlobalValue &GV) {
+      return llvm::is_contained(Exports, GV.getName());
+    });
+
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+  llvm::PassBuilder PB(&TM);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  // The post-link pipeline inlines across the former unit boundaries and
+  // drops functions that are no longer called.
+  llvm::ModulePassManager MPM = PB.buildLTODefaultPipeline(llvm::OptimizationLevel::O2, nullptr);
+  MPM.run(M, MAM);
+}
+
+llvm::Error RunThinLTO(llvm::ArrayRef<CompiledUnit> Units, llvm::TargetMachine &TM,
+                       llvm::ArrayRef<std::string> Exports, unsigned Jobs,
+                       std::vector<llvm::SmallVector<char, 0>> &Objects) {
+  llvm::lto::Config Conf;
+  Conf.CPU = TM.getTargetCPU().str();
+  Conf.MAttrs = {TM.getTargetFeatureString().str()};
+  Conf.Options = TM.Options;
+  Conf.RelocModel = TM.getRelocationModel();
+  Conf.CGOptLevel = TM.getOptLevel();
+  Conf.OptLevel = 2;
+
+  llvm::lto::LTO Lto(std::move(Conf),
+                     llvm::lto::createInProcessThinBackend(llvm::heavyweight_hardware_concurrency(Jobs)));
+
+  // The first definition of a name prevails; two strong definitions are an
+  // error, as they are for the linker.  Names not exported may be internalized
+  // once every unit has imported what it needs.
+  std::map<std::string, bool> Defined; // whether a strong definition was seen
+  for (auto &Unit : Units) {
+    auto Input = llvm::lto::InputFile::create(GetBuffer(Unit));
+    if (!Input)
+      return Input.takeError();
+    std::vector<llvm::lto::SymbolResolution> Resolutions;
+    for (auto &Sym : (*Input)->symbols()) {
+      llvm::lto::SymbolResolution R;
+      if (!Sym.isUndefined()) {
+        bool Strong = !Sym.isWeak() && !Sym.isCommon();
+        auto [It, Inserted] = Defined.try_emplace(Sym.getName().str(), Strong);
+        if (!Inserted && Strong && It->second)
+          return MakeError(llvm::Twine(Unit.Name) + ": duplicate definition of " + Sym.getName());
+        It->second |= Strong;
+        R.Prevailing = Inserted;
+        R.FinalDefinitionInLinkageUnit = true;
+      }
+      R.VisibleToRegularObj = Exports.empty() || llvm::is_contained(Exports, Sym.getName());
+      Resolutions.push_back(R);
+    }
+    if (auto Err = Lto.add(std::move(*Input), Resolutions))
+      return Err;
+  }
+
+  size_t First = Objects.size();
+  Objects.resize(First + Lto.getMaxTasks());
+  auto AddStream = [&](unsigned Task, const llvm::Twine &ModuleName)
+      -> llvm::Expected<std::unique_ptr<llvm::CachedFileStream>> {
+    return std::make_unique<llvm::CachedFileStream>(
+      std::make_unique<llvm::raw_svector_ostream>(Objects[First + Task]));
+  };
+  if (auto Err = Lto.run(AddStream))
+    return Err;
+
+  // Tasks without a module leave their object empty.
+  Objects.erase(std::remove_if(Objects.begin() + First, Objects.end(), [](auto &O) { return O.empty(); }),
+                Objects.end());
+  return llvm::Error::success();
+}
+
+uint64_t GetCodeSize(llvm::ArrayRef<char> Object) {
+  auto Obj = llvm::object::ObjectFile::createObjectFile(
+    llvm::MemoryBufferRef(llvm::StringRef(Object.data(), Object.size()), "object"));
+  if (!Obj) {
+    llvm::consumeError(Obj.takeError());
+    return 0;
+  }
+  uint64_t Size = 0;
+  for (auto &Section : (*Obj)->sections())
+    if (Section.isText())
+      Size += Section.getSize();
+  return Size;
+}
\ No newline at end of file
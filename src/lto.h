@@ -0,0 +1,54 @@
+#ifndef LTO_H
+#define LTO_H
+
+#include <string>
+#include <vector>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include "codegen.h"
+
+/// LTOKind - How separately compiled units are optimized together.
+enum LTOKind {
+  LTONone, // link units after optimizing them separately
+  LTOFull, // link units into one module and optimize it as a whole
+  LTOThin, // optimize units in parallel, importing functions they call
+};
+
+/// CompiledUnit - The optimized bitcode of one source file.
+struct CompiledUnit {
+  std::string Name;
+  llvm::SmallVector<char, 0> Bitcode;
+};
+
+/// CompileUnit - Compile Source into bitcode for TM.  For ThinLTO the bitcode
+/// carries a summary of the module.  With Threads other than 1, functions are
+/// generated and optimized in parallel (see GenerateInParallel).
+llvm::Expected<CompiledUnit> CompileUnit(llvm::StringRef Name, std::string Source, llvm::TargetMachine &TM,
+                                         bool WithSummary, const ProfileOptions &Profile = {},
+                                         unsigned Threads = 1);
+
+/// LinkUnits - Link the bitcode of Units into one module of Context.
+llvm::Expected<std::unique_ptr<llvm::Module>> LinkUnits(llvm::ArrayRef<CompiledUnit> Units,
+                                                        llvm::LLVMContext &Context);
+
+/// RunFullLTO - Optimize a linked module as a whole.  If Exports is not
+/// empty, other functions are internalized so that they can be inlined into
+/// all their callers and dropped.
+void RunFullLTO(llvm::Module &M, llvm::TargetMachine &TM, llvm::ArrayRef<std::string> Exports);
+
+/// RunThinLTO - Optimize and compile Units with ThinLTO on Jobs threads (0 for
+/// all), appending one object file per backend task to Objects.
+llvm::Error RunThinLTO(llvm::ArrayRef<CompiledUnit> Units, llvm::TargetMachine &TM,
+                       llvm::ArrayRef<std::string> Exports, unsigned Jobs,
+                       std::vector<llvm::SmallVector<char, 0>> &Objects);
+
+/// GetCodeSize - Total size of the executable sections of an object file.
+uint64_t GetCodeSize(llvm::ArrayRef<char> Object);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,34 @@
+#include <atomic>
+
+#include <malloc.h>
+#include <sys/resource.h>
+
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "memstats.h"
+
+static std::atomic<bool> Enabled{false};
+
+MemoryUsage GetMemoryUsage() {
+  MemoryUsage Usage = {0, 0};
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  // Chunks in the arenas and those mapped on their own.
+  struct mallinfo2 Info = mallinfo2();
+  Usage.Allocated = Info.uordblks + Info.hblkhd;
+#endif
+  rusage RU;
+  if (getrusage(RUSAGE_SELF, &RU) == 0)
+    Usage.PeakRSS = (size_t)RU.ru_maxrss * 1024; // kilobytes on Linux
+  return Usage;
+}
+
+void EnableMemoryStats(bool Enable) { Enabled = Enable; }
+
+void ReportMemory(const llvm::Twine &Phase) {
+  if (!Enabled)
+    return;
+  MemoryUsage Usage = GetMemoryUsage();
+  llvm::errs() << "Memory after " << Phase << ": " << llvm::format("%.1f", Usage.Allocated / 1048576.0)
+               << " MB allocated, " << llvm::format("%.1f", Usage.PeakRSS / 1048576.0) << " MB peak RSS\n";
+}
@@ -0,0 +1,23 @@
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#include <cstddef>
+
+#include <llvm/ADT/Twine.h>
+
+/// MemoryUsage - Bytes of heap in use and the peak resident set size of the
+/// process so far.  Allocated is 0 where malloc cannot tell.
+struct MemoryUsage {
+  size_t Allocated;
+  size_t PeakRSS;
+};
+
+MemoryUsage GetMemoryUsage();
+
+/// EnableMemoryStats - Make ReportMemory print; it does nothing by default.
+void EnableMemoryStats(bool Enable);
+
+/// ReportMemory - Print the memory usage after Phase to stderr, if enabled.
+void ReportMemory(const llvm::Twine &Phase);
+
+#endif
@@ -0,0 +1,278 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "parallel.h"
+#include "emit.h"
+#include "errors.h"
+#include "memstats.h"
+#include "parser.h"
+#include "toks.h"
+
+namespace {
+
+/// ContextReuse - Functions generated in a worker's LLVMContext before it is
+/// replaced; constants and types interned in a context are never freed.
+const unsigned ContextReuse = 256;
+
+/// FunctionSummary - The attributes InferFunctionAttributes gave a function,
+/// for the declarations of it in the modules of its callers.
+struct FunctionSummary {
+  bool ReadNone = false;
+  bool NoUnwind = false;
+  bool WillReturn = false;
+  bool Speculatable = false;
+};
+
+/// Declaration - A name defined or declared extern, and where it was first
+/// declared.  Code read before Seq cannot call it.
+struct Declaration {
+  unsigned Seq;
+  std::unique_ptr<PrototypeAST> Proto;
+  size_t Job = SIZE_MAX; // the definition, if any
+};
+
+/// FunctionJob - A definition or top-level expression, generated in a module
+/// of its own.
+struct FunctionJob {
+  std::unique_ptr<FunctionAST> AST;
+  unsigned Seq;       // where the body was read
+  bool Linked = true; // false for top-level expressions after the first
+  std::vector<std::pair<std::string, Declaration *>> Callees;
+  std::vector<size_t> Dependents;
+  unsigned Pending = 0; // callees not generated yet
+  std::string Error;
+  llvm::SmallVector<char, 0> Bitcode;
+  FunctionSummary Summary;
+};
+
+/// Worker - The state of a thread generating functions.
+struct Worker {
+  std::unique_ptr<llvm::TargetMachine> TM;
+  LLVMCodegen Codegen;
+  unsigned Modules = 0;
+
+  Worker(std::unique_ptr<llvm::TargetMachine> TM, const ProfileOptions &Profile)
+    : TM(std::move(TM)), Codegen(/*DebugLogging=*/false, Profile) {}
+};
+
+class Scheduler {
+  std::vector<FunctionJob> &Jobs;
+  std::mutex Mutex;
+  std::condition_variable Changed;
+  std::deque<size_t> Ready;
+  size_t Done = 0;
+
+public:
+  explicit Scheduler(std::vector<FunctionJob> &Jobs) : Jobs(Jobs) {
+    for (size_t i = 0; i != Jobs.size(); ++i)
+      if (!Jobs[i].Pending)
+        Ready.push_back(i);
+  }
+
+  void Work(Worker &W);
+
+private:
+  void Generate(Worker &W, size_t Index);
+};
+
+/// Generate - Generate and optimize the function of Job in a new module of W
+/// and keep its bitcode.
+void Scheduler::Generate(Worker &W, size_t Index) {
+  FunctionJob &Job = Jobs[Index];
+  W.Codegen.clearFunctionProtos();
+  W.Codegen.NewModule(W.TM.get(), /*KeepContext=*/++W.Modules % ContextReuse != 0);
+
+  // Declare the callees with what is known about them.  Only the callees
+  // placed before the job have been generated by now.
+  for (auto &[Name, Decl] : Job.Callees) {
+    W.Codegen.addFunctionProto(Name, std::make_unique<PrototypeAST>(*Decl->Proto));
+    if (Decl->Job >= Index || Jobs[Decl->Job].Bitcode.empty())
+      continue;
+    llvm::Function *F = W.Codegen.getFunction(Name);
+    const FunctionSummary &S = Jobs[Decl->Job].Summary;
+    if (S.ReadNone)
+      F->setDoesNotAccessMemory();
+    if (S.NoUnwind)
+      F->setDoesNotThrow();
+    if (S.WillReturn)
+      F->addFnAttr(llvm::Attribute::WillReturn);
+    if (S.Speculatable)
+      F->addFnAttr(llvm::Attribute::Speculatable);
+  }
+
+  SetErrorSink(&Job.Error);
+  llvm::Function *F = Job.AST->accept(W.Codegen);
+  SetErrorSink(nullptr);
+  if (!F)
+    return;
+
+  Job.Summary = {F->doesNotAccessMemory(), F->doesNotThrow(), F->willReturn(), F->isSpeculatable()};
+  llvm::raw_svector_ostream OS(Job.Bitcode);
+  llvm::WriteBitcodeToFile(*W.Codegen.getModule(), OS);
+}
+
+void Scheduler::Work(Worker &W) {
+  std::unique_lock<std::mutex> Lock(Mutex);
+  while (true) {
+    Changed.wait(Lock, [&] { return !Ready.empty() || Done == Jobs.size(); });
+    if (Ready.empty())
+      return;
+    size_t i = Ready.front();
+    Ready.pop_front();
+
+    Lock.unlock();
+    Generate(W, i);
+    Lock.lock();
+
+    ++Done;
+    for (size_t Dependent : Jobs[i].Dependents)
+      if (!--Jobs[Dependent].Pending)
+        Ready.push_back(Dependent);
+    Changed.notify_all();
+  }
+}
+
+/// SameArguments - Whether a redefinition takes the arguments of the
+/// original, as callers generated against either rely on them.
+bool SameArguments(PrototypeAST &A, PrototypeAST &B) {
+  if (A.GetArgs().size() != B.GetArgs().size() || A.IsOperator() != B.IsOperator())
+    return false;
+  for (unsigned i = 0, e = A.GetArgs().size(); i != e; ++i)
+    if (A.IsArrayArg(i) != B.IsArrayArg(i))
+      return false;
+  return true;
+}
+
+} // end anonymous namespace
+
+llvm::Error GenerateInParallel(llvm::StringRef Name, std::string Source, llvm::TargetMachine &TM,
+                               unsigned Threads, const ProfileOptions &Profile, LLVMCodegen &Codegen) {
+  // Parse everything first, in the order MainLoop would handle it.  A
+  // redefinition replaces the body but keeps the place of the original.
+  std::string Error;
+  SetErrorSink(&Error);
+  Parser P(std::make_unique<Lexer>(std::move(Source)));
+  P.AddStandardBinops();
+  P.getNextToken();
+
+  std::vector<FunctionJob> Jobs;
+  std::map<std::string, Declaration> Decls;
+  bool HaveExpr = false;
+  for (unsigned Seq = 0; P.CurTok != tok_eof; ++Seq) {
+    switch (P.CurTok) {
+    case ';': // ignore top-level semicolons.
+      P.getNextToken();
+      break;
+    case tok_def: {
+      auto FnAST = P.ParseDefinition();
+      if (!FnAST) {
+        // Skip token for error recovery.
+        P.getNextToken();
+        break;
+      }
+      PrototypeAST &Proto = *FnAST->GetProto();
+      auto [It, Inserted] = Decls.try_emplace(Proto.GetName(), Declaration{Seq, nullptr});
+      Declaration &D = It->second;
+      if (D.Job != SIZE_MAX && !SameArguments(*D.Proto, Proto)) {
+        LogError("A redefinition must take the same arguments");
+        break;
+      }
+      D.Proto = std::make_unique<PrototypeAST>(Proto);
+      if (D.Job == SIZE_MAX) {
+        D.Job = Jobs.size();
+        Jobs.emplace_back();
+      }
+      Jobs[D.Job].AST = std::move(FnAST);
+      Jobs[D.Job].Seq = Seq;
+      break;
+    }
+    case tok_extern:
+      if (auto ProtoAST = P.ParseExtern()) {
+        std::string Name = ProtoAST->GetName();
+        Decls.try_emplace(Name, Declaration{Seq, std::move(ProtoAST)});
+      } else {
+        P.getNextToken();
+      }
+      break;
+    default:
+      // Only the first top-level expression is kept in the module; the
+      // others are still generated for their errors.
+      if (auto FnAST = P.ParseTopLevelExpr()) {
+        Jobs.emplace_back();
+        Jobs.back().AST = std::move(FnAST);
+        Jobs.back().Seq = Seq;
+        Jobs.back().Linked = !HaveExpr;
+        HaveExpr = true;
+      } else {
+        P.getNextToken();
+      }
+      break;
+    }
+  }
+  SetErrorSink(nullptr);
+  if (!Error.empty())
+    return llvm::createStringError(llvm::inconvertibleErrorCode(), Error);
+  ReportMemory(Name + ": parsing");
+
+  // A body sees the names declared before it.  It waits for the definitions
+  // placed before it; later ones only occur in recursive cycles through
+  // redefinitions, and are called without their attributes.
+  for (size_t i = 0; i != Jobs.size(); ++i) {
+    FunctionJob &Job = Jobs[i];
+    std::set<std::string> Names;
+    CollectCallees(Job.AST->GetBody(), Names);
+    Names.erase(Job.AST->GetProto()->GetName());
+    for (auto &Name : Names) {
+      auto It = Decls.find(Name);
+      if (It == Decls.end() || It->second.Seq >= Job.Seq)
+        continue;
+      Job.Callees.emplace_back(Name, &It->second);
+      if (It->second.Job < i) {
+        Jobs[It->second.Job].Dependents.push_back(i);
+        ++Job.Pending;
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<Worker>> Workers;
+  Scheduler S(Jobs);
+  Threads = std::max<size_t>(std::min<size_t>(Threads, Jobs.size()), 1);
+  for (unsigned i = 0; i != Threads; ++i) {
+    Workers.push_back(std::make_unique<Worker>(CloneTargetMachine(TM), Profile));
+  }
+  std::vector<std::thread> Pool;
+  for (unsigned i = 1; i < Threads; ++i)
+    Pool.emplace_back([&S, &W = *Workers[i]] { S.Work(W); });
+  S.Work(*Workers[0]);
+  for (auto &T : Pool)
+    T.join();
+
+  // Report the first error in source order and link the rest in the order
+  // they were read, so the output does not depend on the schedule.
+  const FunctionJob *Failed = nullptr;
+  for (auto &Job : Jobs)
+    if (!Job.Error.empty() && (!Failed || Job.Seq < Failed->Seq))
+      Failed = &Job;
+  if (Failed)
+    return llvm::createStringError(llvm::inconvertibleErrorCode(), Failed->Error);
+
+  Codegen.NewModule(&TM);
+  for (auto &Job : Jobs) {
+    if (!Job.Linked)
+      continue;
+    llvm::StringRef Bitcode(Job.Bitcode.data(), Job.Bitcode.size());
+    if (auto Err = Codegen.LinkBitcode(llvm::MemoryBufferRef(Bitcode, Job.AST->GetProto()->GetName())))
+      return Err;
+  }
+  return llvm::Error::success();
+}
@@ -0,0 +1,23 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <string>
+
+#include <llvm/Support/Error.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include "codegen.h"
+
+/// GenerateInParallel - Read Source, the unit Name, like Interpreter::MainLoop
+/// does, but generate and optimize every definition in a module of its own on
+/// Threads threads, with the profiling of Profile, then link the modules into
+/// a new module of Codegen in source order.  A function is generated after the
+/// functions it calls, so that it can rely on their inferred attributes,
+/// except in recursive cycles.  The module is not passed through
+/// OptimizeModule yet.  Calls are never specialized, since callees are only
+/// declared in the module of the caller, so the code differs from that of a
+/// sequential compile; it is the same for any number of threads.
+llvm::Error GenerateInParallel(llvm::StringRef Name, std::string Source, llvm::TargetMachine &TM,
+                               unsigned Threads, const ProfileOptions &Profile, LLVMCodegen &Codegen);
+
+#endif
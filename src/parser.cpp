@@ -1,7 +1,11 @@
+#include <algorithm>
+#include <bit>
 #include <memory>
 #include <map>
 #include <math.h>
 
+#include <llvm/ADT/Hashing.h>
+
 #include "parser.h"
 #include "lexer.h"
 #include "ast.h"
@@ -15,10 +19,171 @@ int Parser::getNextToken() {
   return CurTok = TheLexer->gettok();
 }
 
+/// Resolve - The expression a RefExprAST stands for.
+static ExprAST *Resolve(ExprAST *E) {
+  return E->GetKind() == ExprAST::EK_Ref ? static_cast<RefExprAST *>(E)->GetTarget() : E;
+}
+
+/// SameOperand - Whether two children of interned expressions are the same.
+/// Interned children are unique, so only leaves need comparing.
+static bool SameOperand(ExprAST *A, ExprAST *B) {
+  A = Resolve(A);
+  B = Resolve(B);
+  if (A == B)
+    return true;
+  if (A->GetKind() != B->GetKind())
+    return false;
+  if (A->GetKind() == ExprAST::EK_Number)
+    return std::bit_cast<uint64_t>(static_cast<NumberExprAST *>(A)->GetVal()) ==
+           std::bit_cast<uint64_t>(static_cast<NumberExprAST *>(B)->GetVal());
+  if (A->GetKind() == ExprAST::EK_Variable)
+    return static_cast<VariableExprAST *>(A)->GetName() == static_cast<VariableExprAST *>(B)->GetName();
+  return false;
+}
+
+static bool SameOperands(std::vector<std::unique_ptr<ExprAST>> &A, std::vector<std::unique_ptr<ExprAST>> &B) {
+  return A.size() == B.size() && std::equal(A.begin(), A.end(), B.begin(), [](auto &X, auto &Y) {
+    return SameOperand(X.get(), Y.get());
+  });
+}
+
+/// SameNode - Whether two interned expressions of the same hash compute the
+/// same thing.
+static bool SameNode(ExprAST *A, ExprAST *B) {
+  if (A->GetKind() != B->GetKind())
+    return false;
+  switch (A->GetKind()) {
+  case ExprAST::EK_Binary: {
+    auto *X = static_cast<BinaryExprAST *>(A), *Y = static_cast<BinaryExprAST *>(B);
+    return X->GetOp() == Y->GetOp() && SameOperand(X->GetLHS(), Y->GetLHS()) &&
+           SameOperand(X->GetRHS(), Y->GetRHS());
+  }
+  case ExprAST::EK_Unary: {
+    auto *X = static_cast<UnaryExprAST *>(A), *Y = static_cast<UnaryExprAST *>(B);
+    return X->GetOpcode() == Y->GetOpcode() && SameOperand(X->GetOperand(), Y->GetOperand());
+  }
+  case ExprAST::EK_Call: {
+    auto *X = static_cast<CallExprAST *>(A), *Y = static_cast<CallExprAST *>(B);
+    return X->GetCallee() == Y->GetCallee() && SameOperands(X->GetArgs(), Y->GetArgs());
+  }
+  case ExprAST::EK_Index: {
+    auto *X = static_cast<IndexExprAST *>(A), *Y = static_cast<IndexExprAST *>(B);
+    return X->GetName() == Y->GetName() && SameOperand(X->GetIndex(), Y->GetIndex());
+  }
+  default:
+    return false;
+  }
+}
+
+/// Mix - Combine a hash with another value.  Called for every node, so it is
+/// a single multiply rather than llvm::hash_combine.
+static uint32_t Mix(uint64_t Hash, uint64_t Value) {
+  Hash = (Hash ^ Value) * 0x9e3779b97f4a7c15ULL;
+  return uint32_t(Hash >> 32);
+}
+
+/// HashName - A hash of an identifier.  Names are short, so a byte loop is
+/// cheaper than setting up llvm::hash_value for each one.
+static uint64_t HashName(const std::string &Name) {
+  uint64_t Hash = Name.size();
+  for (char C : Name)
+    Hash = Hash * 31 + (unsigned char)C;
+  return Hash;
+}
+
+/// HashOf - The structural hash of a leaf or an interned expression, or 0
+/// for expressions that are not shared, such as if or var.
+static uint32_t HashOf(ExprAST *E) {
+  E = Resolve(E);
+  switch (E->GetKind()) {
+  case ExprAST::EK_Number:
+    return Mix(ExprAST::EK_Number, std::bit_cast<uint64_t>(static_cast<NumberExprAST *>(E)->GetVal())) | 1;
+  case ExprAST::EK_Variable:
+    return Mix(ExprAST::EK_Variable, HashName(static_cast<VariableExprAST *>(E)->GetName())) | 1;
+  default:
+    return E->GetHash();
+  }
+}
+
+/// ShareSubexpressions - Whether Intern shares anything; see
+/// EnableSubexpressionSharing.
+static bool ShareSubexpressions = false;
+
+void EnableSubexpressionSharing(bool Enable) {
+  ShareSubexpressions = Enable;
+}
+
+/// Intern - Return E, or, if sharing is enabled, a reference to an identical
+/// expression parsed before in the same definition.  Generated code tends to
+/// repeat subexpressions many times; sharing them keeps the AST small and
+/// lets codegen emit a pure one once.  The children of E are interned
+/// already, so comparing two candidates only looks one level deep.
+std::unique_ptr<ExprAST> Parser::Intern(std::unique_ptr<ExprAST> E) {
+  if (!ShareSubexpressions)
+    return E;
+  uint64_t Hash = E->GetKind();
+  auto Combine = [&](ExprAST *Child) {
+    uint32_t Operand = HashOf(Child);
+    Hash = Mix(Hash, Operand);
+    return Operand != 0;
+  };
+  switch (E->GetKind()) {
+  case ExprAST::EK_Binary: {
+    auto *B = static_cast<BinaryExprAST *>(E.get());
+    Hash = Mix(Hash, B->GetOp());
+    if (!Combine(B->GetLHS()) || !Combine(B->GetRHS()))
+      return E;
+    break;
+  }
+  case ExprAST::EK_Unary: {
+    auto *U = static_cast<UnaryExprAST *>(E.get());
+    Hash = Mix(Hash, U->GetOpcode());
+    if (!Combine(U->GetOperand()))
+      return E;
+    break;
+  }
+  case ExprAST::EK_Call: {
+    auto *C = static_cast<CallExprAST *>(E.get());
+    Hash = Mix(Hash, HashName(C->GetCallee()));
+    for (auto &Arg : C->GetArgs())
+      if (!Combine(Arg.get()))
+        return E;
+    break;
+  }
+  case ExprAST::EK_Index: {
+    auto *I = static_cast<IndexExprAST *>(E.get());
+    Hash = Mix(Hash, HashName(I->GetName()));
+    if (!Combine(I->GetIndex()))
+      return E;
+    break;
+  }
+  default:
+    return E;
+  }
+
+  // 0 marks expressions that are not shared.
+  uint32_t Key = uint32_t(Hash) | 1;
+  auto &Candidates = Interned[Key];
+  for (ExprAST *Candidate : Candidates)
+    if (SameNode(Candidate, E.get())) {
+      Candidate->SetShared();
+      return std::make_unique<RefExprAST>(Candidate);
+    }
+  Candidates.push_back(E.get());
+  E->SetHash(Key);
+  return E;
+}
+
+/// ClearInterned - Forget the expressions of the last definition; references
+/// never cross definitions.
+void Parser::ClearInterned() {
+  Interned.clear();
+}
+
 /// numberexpr ::= number
 std::unique_ptr<ExprAST> Parser::ParseNumberExpr() {
-  if (isnan(TheLexer->NumVal))
-    return LogError("invalid double specified");
+  if (!TheLexer->NumError.empty())
+    return LogError(TheLexer->NumError.c_str());
   auto Result = std::make_unique<NumberExprAST>(TheLexer->NumVal);
   getNextToken(); // consume the number
   return std::move(Result);
@@ -39,12 +204,24 @@ std::unique_ptr<ExprAST> Parser::ParseParenExpr() {
 
 /// identifierexpr
 ///   ::= identifier
+///   ::= identifier '[' expression ']'
 ///   ::= identifier '(' expression* ')'
 std::unique_ptr<ExprAST> Parser::ParseIdentifierExpr() {
   std::string IdName = TheLexer->IdentifierStr;
 
   getNextToken(); // eat identifier.
 
+  if (CurTok == '[') { // Array element.
+    getNextToken(); // eat [
+    auto Index = ParseExpression();
+    if (!Index)
+      return nullptr;
+    if (CurTok != ']')
+      return LogError("expected ']'");
+    getNextToken(); // eat ]
+    return Intern(std::make_unique<IndexExprAST>(IdName, std::move(Index)));
+  }
+
   if (CurTok != '(') // Simple variable ref.
     return std::make_unique<VariableExprAST>(IdName);
 
@@ -70,7 +247,7 @@ std::unique_ptr<ExprAST> Parser::ParseIdentifierExpr() {
   // Eat the ')'.
   getNextToken();
 
-  return std::make_unique<CallExprAST>(IdName, std::move(Args));
+  return Intern(std::make_unique<CallExprAST>(IdName, std::move(Args)));
 }
 
 /// primary
@@ -78,6 +255,9 @@ std::unique_ptr<ExprAST> Parser::ParseIdentifierExpr() {
 ///   ::= numberexpr
 ///   ::= parenexpr
 ///   ::= ifexpr
+///   ::= forexpr
+///   ::= varexpr
+///   ::= vectorexpr
 std::unique_ptr<ExprAST> Parser::ParsePrimary() {
   switch (CurTok) {
   default:
@@ -91,12 +271,34 @@ std::unique_ptr<ExprAST> Parser::ParsePrimary() {
   case tok_if:
     return ParseIfExpr();
   case tok_for:
+  case tok_parfor:
     return ParseForExpr();
   case tok_var:
     return ParseVarExpr();
+  case tok_vec:
+    return ParseVectorExpr();
   }
 }
 
+/// AddStandardBinops - Install the builtin binary operators.
+/// 1 is lowest precedence.
+void Parser::AddStandardBinops() {
+  AddBinop('=', 2);
+  AddBinop('<', 10);
+  AddBinop('+', 20);
+  AddBinop('-', 30);
+  AddBinop('*', 40);
+}
+
+/// GetBinopPrecedences - The precedence of every defined binary operator.
+std::map<char, int> Parser::GetBinopPrecedences() const {
+  std::map<char, int> Precedences;
+  for (unsigned Op = 0; Op != BinopPrecedence.size(); ++Op)
+    if (BinopPrecedence[Op] > 0)
+      Precedences[(char)Op] = BinopPrecedence[Op];
+  return Precedences;
+}
+
 /// GetTokPrecedence - Get the precedence of the pending binary operator token.
 int Parser::GetTokPrecedence() {
   if (!isascii(CurTok))
@@ -138,7 +340,7 @@ std::unique_ptr<ExprAST> Parser::ParseBinOpRHS(int ExprPrec, std::unique_ptr<Exp
         return nullptr;
     }
     // Merge LHS/RHS.
-    LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+    LHS = Intern(std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS)));
   }
 }
 
@@ -154,7 +356,7 @@ std::unique_ptr<ExprAST> Parser::ParseExpression() {
 }
 
 /// prototype
-///   ::= id '(' id* ')'
+///   ::= id '(' (id | id '[' ']')* ')'
 std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
   std::string FnName;
   unsigned Kind = 0;  // 0 = identifier, 1 = unary, 2 = binary.
@@ -187,6 +389,8 @@ std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
 
       // Read the precedence if present.
       if (CurTok == tok_number) {
+        if (!TheLexer->NumError.empty())
+          return LogErrorP(TheLexer->NumError.c_str());
         if (TheLexer->NumVal < 1 || TheLexer->NumVal > 100)
           return LogErrorP("Invalid precedence: must be 1..100");
         BinaryPrecedence = (unsigned)TheLexer->NumVal;
@@ -200,8 +404,20 @@ std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
 
   // Read the list of argument names.
   std::vector<std::string> ArgNames;
-  while (getNextToken() == tok_identifier)
+  std::vector<bool> ArrayArgs;
+  getNextToken();  // eat '('.
+  while (CurTok == tok_identifier) {
     ArgNames.push_back(TheLexer->IdentifierStr);
+    getNextToken();  // eat identifier.
+
+    bool IsArray = CurTok == '[';
+    if (IsArray) {
+      if (getNextToken() != ']')
+        return LogErrorP("Expected ']' in array argument");
+      getNextToken();  // eat ']'.
+    }
+    ArrayArgs.push_back(IsArray);
+  }
   if (CurTok != ')')
     return LogErrorP("Expected ')' in prototype");
 
@@ -211,21 +427,32 @@ std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
   // Verify right number of names for operator.
   if (Kind && ArgNames.size() != Kind)
     return LogErrorP("Invalid number of operands for operator");
+  if (Kind && std::find(ArrayArgs.begin(), ArrayArgs.end(), true) != ArrayArgs.end())
+    return LogErrorP("Operators cannot take array arguments");
 
-  auto resAst = std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), Kind != 0, BinaryPrecedence);
+  auto resAst = std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), Kind != 0, BinaryPrecedence,
+                                               std::move(ArrayArgs));
   if (resAst->IsOperator())
     AddBinop(resAst->GetOperatorName(), BinaryPrecedence);
   return std::move(resAst);
 }
 
-/// definition ::= 'def' prototype expression
+/// definition ::= 'def' 'memo'? prototype expression
 std::unique_ptr<FunctionAST> Parser::ParseDefinition() {
   getNextToken();  // eat def.
+
+  bool Memo = CurTok == tok_memo;
+  if (Memo)
+    getNextToken();  // eat memo.
+
   auto Proto = ParsePrototype();
   if (!Proto) return nullptr;
 
-  if (auto E = ParseExpression())
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+  ClearInterned();
+  auto E = ParseExpression();
+  ClearInterned();
+  if (E)
+    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E), Memo);
   return nullptr;
 }
 
@@ -237,7 +464,10 @@ std::unique_ptr<PrototypeAST> Parser::ParseExtern() {
 
 /// toplevelexpr ::= expression
 std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr() {
-  if (auto E = ParseExpression()) {
+  ClearInterned();
+  auto E = ParseExpression();
+  ClearInterned();
+  if (E) {
     // Make an anonymous proto.
     auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>(), 0, 0);
     return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
@@ -274,7 +504,12 @@ std::unique_ptr<ExprAST> Parser::ParseIfExpr() {
   return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then), std::move(Else));
 }
 
+/// forexpr
+///   ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
+///   ::= 'parfor' identifier '=' expr ',' expr (',' expr)? ('reduce' ('+' | '*'))?
+///       'in' expression
 std::unique_ptr<ExprAST> Parser::ParseForExpr() {
+  bool Parallel = CurTok == tok_parfor;
   getNextToken(); // eat for
 
   if (CurTok != tok_identifier)
@@ -307,6 +542,16 @@ std::unique_ptr<ExprAST> Parser::ParseForExpr() {
       return nullptr;
   }
 
+  // Parallel loops may combine their body values.
+  char ReduceOp = 0;
+  if (Parallel && CurTok == tok_reduce) {
+    getNextToken();  // eat 'reduce'.
+    if (CurTok != '+' && CurTok != '*')
+      return LogError("expected '+' or '*' after reduce");
+    ReduceOp = CurTok;
+    getNextToken();  // eat the operator.
+  }
+
   if (CurTok != tok_in)
     return LogError("expected 'in' after for");
   getNextToken();  // eat 'in'.
@@ -315,7 +560,8 @@ std::unique_ptr<ExprAST> Parser::ParseForExpr() {
   if (!Body)
     return nullptr;
 
-  return std::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End), std::move(Step), std::move(Body));
+  return std::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End), std::move(Step), std::move(Body),
+                                      Parallel, ReduceOp);
 }
 
 std::unique_ptr<ExprAST> Parser::ParseUnary() {
@@ -327,7 +573,7 @@ std::unique_ptr<ExprAST> Parser::ParseUnary() {
   int Opc = CurTok;
   getNextToken();
   if (auto Operand = ParseUnary())
-    return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+    return Intern(std::make_unique<UnaryExprAST>(Opc, std::move(Operand)));
   return nullptr;
 }
 
@@ -373,4 +619,36 @@ std::unique_ptr<ExprAST> Parser::ParseVarExpr() {
     return nullptr;
 
   return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+}
+
+/// vectorexpr
+///   ::= ('vec' | 'vec2' | 'vec4' | 'vec8') '(' expression (',' expression)* ')'
+std::unique_ptr<ExprAST> Parser::ParseVectorExpr() {
+  unsigned Width = TheLexer->VecWidth;
+  getNextToken();  // eat vecN.
+
+  if (CurTok != '(')
+    return LogError("expected '(' after vector type");
+  getNextToken();  // eat (.
+
+  std::vector<std::unique_ptr<ExprAST>> Elements;
+  while (true) {
+    auto Element = ParseExpression();
+    if (!Element)
+      return nullptr;
+    Elements.push_back(std::move(Element));
+
+    if (CurTok == ')')
+      break;
+    if (CurTok != ',')
+      return LogError("Expected ')' or ',' in vector elements");
+    getNextToken();
+  }
+  getNextToken();  // eat ).
+
+  // A single element is broadcast to every lane.
+  if (Elements.size() != 1 && Elements.size() != Width)
+    return LogError(Width ? "Wrong number of vector elements" : "vec() takes a single element to broadcast");
+
+  return std::make_unique<VectorExprAST>(Width, std::move(Elements));
 }
\ No newline at end of file
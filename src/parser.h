@@ -1,12 +1,21 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include <array>
 #include <memory>
 #include <map>
 
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/TinyPtrVector.h>
+
 #include "ast.h"
 #include "lexer.h"
 
+/// EnableSubexpressionSharing - Make parsers share repeated subexpressions
+/// within a definition (see Parser::Intern).  Off by default, since it costs
+/// parse time and pays off only on sources that repeat themselves.
+void EnableSubexpressionSharing(bool Enable);
+
 class Parser {
 public:
     int CurTok;
@@ -29,12 +38,23 @@ public:
     std::unique_ptr<ExprAST> ParseForExpr();
     std::unique_ptr<ExprAST> ParseUnary();
     std::unique_ptr<ExprAST> ParseVarExpr();
-    void AddBinop(char op, int precedence) { BinopPrecedence[op] = precedence; }
+    std::unique_ptr<ExprAST> ParseVectorExpr();
+    void AddBinop(char op, int precedence) { BinopPrecedence[(unsigned char)op] = precedence; }
+    void AddStandardBinops();
+    std::map<char, int> GetBinopPrecedences() const;
 
 private:
     std::unique_ptr<Lexer> TheLexer;
-    /// BinopPrecedence - This holds the precedence for each binary operator that is defined.
-    std::map<char, int> BinopPrecedence;
+    /// BinopPrecedence - This holds the precedence for each binary operator
+    /// that is defined, indexed by its character; 0 for other characters.
+    std::array<int, 256> BinopPrecedence = {};
+    /// Interned - The binary, unary, call and index expressions of the
+    /// definition being parsed by structural hash, to share repeated
+    /// subexpressions; see Intern.
+    llvm::DenseMap<uint32_t, llvm::TinyPtrVector<ExprAST *>> Interned;
+
+    std::unique_ptr<ExprAST> Intern(std::unique_ptr<ExprAST> E);
+    void ClearInterned();
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,53 @@
+#include <cerrno>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+static bool ReadAll(int FD, char *Buf, size_t Size) {
+  while (Size) {
+    ssize_t N = read(FD, Buf, Size);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    Buf += N;
+    Size -= N;
+  }
+  return true;
+}
+
+static bool WriteAll(int FD, const char *Buf, size_t Size) {
+  while (Size) {
+    // Don't die of SIGPIPE when the peer has gone away.
+    ssize_t N = send(FD, Buf, Size, MSG_NOSIGNAL);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    Buf += N;
+    Size -= N;
+  }
+  return true;
+}
+
+FrameStatus ReadFrame(int FD, char &Kind, std::string &Payload, uint32_t MaxSize) {
+  uint32_t Size;
+  if (!ReadAll(FD, &Kind, 1) || !ReadAll(FD, reinterpret_cast<char *>(&Size), sizeof(Size)))
+    return FS_Closed;
+  // The size comes from the peer; don't let it pick the allocation.
+  if (Size > MaxSize)
+    return FS_TooLarge;
+  Payload.resize(Size);
+  return ReadAll(FD, Payload.data(), Size) ? FS_Ok : FS_Closed;
+}
+
+bool WriteFrame(int FD, char Kind, const std::string &Payload) {
+  char Header[1 + sizeof(uint32_t)];
+  uint32_t Size = Payload.size();
+  Header[0] = Kind;
+  memcpy(Header + 1, &Size, sizeof(Size));
+  return WriteAll(FD, Header, sizeof(Header)) && WriteAll(FD, Payload.data(), Payload.size());
+}
\ No newline at end of file
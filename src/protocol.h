@@ -0,0 +1,39 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstdint>
+#include <string>
+
+/// Frames of the compile server protocol.  Requests and responses are a kind
+/// byte, a payload length (uint32_t, host byte order) and the payload:
+///   eval    - source: externs and one top-level expression; answered with a
+///             result holding its value as a double
+///   compile - source: a whole program; answered with its object file
+///   error   - response payload is the error message
+enum FrameKind : char {
+  FK_Eval = 'e',
+  FK_Compile = 'c',
+  FK_Result = 'r',
+  FK_Object = 'o',
+  FK_Error = 'x',
+};
+
+/// MaxRequestSize - Largest request payload the server reads; a larger one is
+/// answered with an error and the connection is closed.
+const uint32_t MaxRequestSize = 16 << 20;
+
+/// FrameStatus - What ReadFrame found.
+enum FrameStatus {
+  FS_Ok,
+  FS_Closed,   // EOF or error
+  FS_TooLarge, // the payload is larger than MaxSize and was not read
+};
+
+/// ReadFrame - Read one frame from FD, with a payload of at most MaxSize
+/// bytes.  After FS_TooLarge the stream is out of step and must be closed.
+FrameStatus ReadFrame(int FD, char &Kind, std::string &Payload, uint32_t MaxSize = UINT32_MAX);
+
+/// WriteFrame - Write one frame to FD.  Returns false on error.
+bool WriteFrame(int FD, char Kind, const std::string &Payload);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,372 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "runtime.h"
+
+namespace {
+
+/// InPool - Set on pool threads and on a caller while it runs a parfor, so
+/// that nested parfors run serially instead of waiting on the pool.
+thread_local bool InPool = false;
+
+double Identity(int32_t ReduceOp) { return ReduceOp == '*' ? 1.0 : 0.0; }
+
+double Combine(int32_t ReduceOp, double Acc, double V) {
+  return ReduceOp == '*' ? Acc * V : Acc + V;
+}
+
+/// ParForJob - One running parfor loop.  Every participating thread owns a
+/// slot holding a deque of iteration ranges and its partial result.  The
+/// owner splits and pops ranges at the back of its deque; idle threads steal
+/// the largest ranges from the front of other slots.
+class ParForJob {
+  struct alignas(64) Slot {
+    std::mutex Mutex;
+    std::deque<std::pair<int64_t, int64_t>> Ranges;
+    double Partial = 0.0;
+  };
+
+  ParForKernel Kernel;
+  void *Env;
+  int32_t ReduceOp;
+  int64_t Grain;
+  std::vector<Slot> Slots;
+  std::atomic<int64_t> Remaining;  // Iterations not finished yet.
+  std::mutex DoneMutex;
+  std::condition_variable DoneCond;
+
+public:
+  /// Queued - Number of ranges waiting in some deque.
+  std::atomic<int64_t> Queued{0};
+
+  ParForJob(int64_t Trip, ParForKernel Kernel, void *Env, int32_t ReduceOp, unsigned NumSlots)
+    : Kernel(Kernel), Env(Env), ReduceOp(ReduceOp), Slots(NumSlots), Remaining(Trip) {
+    // Small chunks balance the load, but every chunk costs a kernel call.
+    Grain = std::max<int64_t>(1, Trip / (NumSlots * 16));
+    for (unsigned S = 0; S != NumSlots; ++S) {
+      Slots[S].Partial = Identity(ReduceOp);
+      int64_t Lo = Trip * S / NumSlots, Hi = Trip * (S + 1) / NumSlots;
+      if (Lo != Hi)
+        Push(S, {Lo, Hi});
+    }
+  }
+
+  /// Participate - Run chunks of the loop from slot S, then steal from the
+  /// other slots, until no range is left to take.
+  void Participate(unsigned S) {
+    std::pair<int64_t, int64_t> R;
+    while (Pop(S, R) || Steal(S, R)) {
+      // Leave the upper halves for thieves until the chunk is small enough.
+      while (R.second - R.first > Grain) {
+        int64_t Mid = R.first + (R.second - R.first) / 2;
+        Push(S, {Mid, R.second});
+        R.second = Mid;
+      }
+
+      Slots[S].Partial = Combine(ReduceOp, Slots[S].Partial, Kernel(R.first, R.second, Env));
+
+      int64_t Size = R.second - R.first;
+      if (Remaining.fetch_sub(Size, std::memory_order_acq_rel) == Size) {
+        std::lock_guard<std::mutex> Lock(DoneMutex);
+        DoneCond.notify_all();
+      }
+    }
+  }
+
+  /// Wait - Wait until every iteration has run and combine the partial
+  /// results in slot order.
+  double Wait() {
+    std::unique_lock<std::mutex> Lock(DoneMutex);
+    DoneCond.wait(Lock, [&] { return Remaining.load(std::memory_order_acquire) == 0; });
+
+    double Result = Identity(ReduceOp);
+    for (auto &S : Slots)
+      Result = Combine(ReduceOp, Result, S.Partial);
+    return Result;
+  }
+
+private:
+  void Push(unsigned S, std::pair<int64_t, int64_t> R) {
+    std::lock_guard<std::mutex> Lock(Slots[S].Mutex);
+    Slots[S].Ranges.push_back(R);
+    Queued.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  bool Pop(unsigned S, std::pair<int64_t, int64_t> &R) {
+    std::lock_guard<std::mutex> Lock(Slots[S].Mutex);
+    if (Slots[S].Ranges.empty())
+      return false;
+    R = Slots[S].Ranges.back();
+    Slots[S].Ranges.pop_back();
+    Queued.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  bool Steal(unsigned S, std::pair<int64_t, int64_t> &R) {
+    for (unsigned i = 1, e = Slots.size(); i != e; ++i) {
+      Slot &Victim = Slots[(S + i) % e];
+      std::lock_guard<std::mutex> Lock(Victim.Mutex);
+      if (Victim.Ranges.empty())
+        continue;
+      R = Victim.Ranges.front();
+      Victim.Ranges.pop_front();
+      Queued.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+    return false;
+  }
+};
+
+/// ThreadPool - Worker threads that help run the active parfor jobs.  The
+/// thread starting a job always works on it too.
+class ThreadPool {
+  std::vector<std::thread> Workers;
+  std::mutex Mutex;
+  std::condition_variable Cond;
+  std::vector<std::shared_ptr<ParForJob>> Jobs;
+  bool Stop = false;
+
+public:
+  ThreadPool(unsigned NumWorkers) {
+    for (unsigned i = 0; i != NumWorkers; ++i)
+      Workers.emplace_back([this, i] { WorkerLoop(i + 1); });
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Stop = true;
+    }
+    Cond.notify_all();
+    for (auto &W : Workers)
+      W.join();
+  }
+
+  /// NumSlots - Number of threads that can work on one job.
+  unsigned NumSlots() const { return Workers.size() + 1; }
+
+  double Run(const std::shared_ptr<ParForJob> &Job) {
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Jobs.push_back(Job);
+    }
+    Cond.notify_all();
+
+    InPool = true;
+    Job->Participate(0);
+    InPool = false;
+    double Result = Job->Wait();
+
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Jobs.erase(std::find(Jobs.begin(), Jobs.end(), Job));
+    return Result;
+  }
+
+private:
+  void WorkerLoop(unsigned Slot) {
+    InPool = true;
+    std::unique_lock<std::mutex> Lock(Mutex);
+    while (!Stop) {
+      auto It = std::find_if(Jobs.begin(), Jobs.end(), [](const std::shared_ptr<ParForJob> &J) {
+        return J->Queued.load(std::memory_order_relaxed) > 0;
+      });
+      if (It == Jobs.end()) {
+        // Ranges split off by busy threads do not notify, so poll while jobs
+        // are running and sleep otherwise.
+        if (Jobs.empty())
+          Cond.wait(Lock);
+        else
+          Cond.wait_for(Lock, std::chrono::microseconds(200));
+        continue;
+      }
+
+      std::shared_ptr<ParForJob> Job = *It;
+      Lock.unlock();
+      Job->Participate(Slot);
+      Lock.lock();
+    }
+  }
+};
+
+/// MaxThreads - Largest KS_NUM_THREADS taken; larger values are mistakes.
+const long MaxThreads = 1024;
+
+/// GetPool - The process-wide pool, sized by KS_NUM_THREADS or the number of
+/// hardware threads.  Values that are not a number from 1 to MaxThreads are
+/// ignored.
+ThreadPool &GetPool() {
+  static ThreadPool Pool([] {
+    unsigned Threads = std::thread::hardware_concurrency();
+    if (const char *Env = std::getenv("KS_NUM_THREADS")) {
+      char *End;
+      errno = 0;
+      long N = std::strtol(Env, &End, 10);
+      if (End != Env && *End == '\0' && errno == 0 && N > 0 && N <= MaxThreads)
+        Threads = N;
+    }
+    return Threads > 1 ? Threads - 1 : 0;
+  }());
+  return Pool;
+}
+
+} // end anonymous namespace
+
+extern "C" double putchard(double X) {
+  fputc((char)X, stderr);
+  return 0;
+}
+
+extern "C" double printd(double X) {
+  printf("%f\n", X);
+  return 0;
+}
+
+extern "C" double ks_parallel_for(int64_t Trip, ParForKernel Kernel, void *Env, int32_t ReduceOp) {
+  if (Trip <= 0)
+    return Identity(ReduceOp);
+
+  // Nested loops and single-threaded pools run on the calling thread.
+  ThreadPool &Pool = GetPool();
+  if (InPool || Pool.NumSlots() == 1 || Trip == 1)
+    return Combine(ReduceOp, Identity(ReduceOp), Kernel(0, Trip, Env));
+
+  return Pool.Run(std::make_shared<ParForJob>(Trip, Kernel, Env, ReduceOp, Pool.NumSlots()));
+}
+
+
+namespace {
+
+/// ReadCycles - A cheap timestamp: the time stamp counter where there is one.
+uint64_t ReadCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct ProfileFrame {
+  ks_profile_site *Site;
+  uint64_t Start;
+  uint64_t Children; // time spent in profiled callees
+};
+
+/// ProfileStack - The profiled calls running on a thread, and how many calls
+/// of each site, by Id, are among them.
+struct ProfileStack {
+  std::vector<ProfileFrame> Frames;
+  std::vector<uint32_t> Depth;
+};
+
+thread_local ProfileStack Stack;
+
+std::mutex ProfileMutex;
+std::vector<ks_profile_site *> ProfileSites;
+uint32_t NextSiteId = 1;
+/// ProfileStart - When the first site was seen, to convert cycles to seconds.
+uint64_t ProfileStartCycles;
+std::chrono::steady_clock::time_point ProfileStartTime;
+
+uint32_t RegisterSite(ks_profile_site *Site) {
+  std::lock_guard<std::mutex> Lock(ProfileMutex);
+  std::atomic_ref<uint32_t> Id(Site->Id);
+  if (uint32_t Known = Id.load(std::memory_order_relaxed))
+    return Known;
+  if (ProfileSites.empty()) {
+    ProfileStartCycles = ReadCycles();
+    ProfileStartTime = std::chrono::steady_clock::now();
+  }
+  ProfileSites.push_back(Site);
+  // Ids are never reused, so that call depths of forgotten sites cannot leak
+  // into new ones.
+  Id.store(NextSiteId, std::memory_order_release);
+  return NextSiteId++;
+}
+
+void PrintJSONString(const char *S) {
+  fputc('"', stderr);
+  for (; *S; ++S) {
+    if (*S == '"' || *S == '\\')
+      fputc('\\', stderr);
+    if ((unsigned char)*S < 0x20)
+      fprintf(stderr, "\\u%04x", *S);
+    else
+      fputc(*S, stderr);
+  }
+  fputc('"', stderr);
+}
+
+} // end anonymous namespace
+
+extern "C" void ks_profile_enter(ks_profile_site *Site) {
+  uint32_t Id = std::atomic_ref<uint32_t>(Site->Id).load(std::memory_order_acquire);
+  if (!Id)
+    Id = RegisterSite(Site);
+  std::atomic_ref<uint64_t>(Site->Calls).fetch_add(1, std::memory_order_relaxed);
+  if (Stack.Depth.size() < Id)
+    Stack.Depth.resize(Id);
+  ++Stack.Depth[Id - 1];
+  Stack.Frames.push_back({Site, 0, 0});
+  Stack.Frames.back().Start = ReadCycles();
+}
+
+extern "C" void ks_profile_exit(ks_profile_site *Site) {
+  uint64_t Now = ReadCycles();
+  if (Stack.Frames.empty())
+    return;
+  ProfileFrame Frame = Stack.Frames.back();
+  Stack.Frames.pop_back();
+  uint64_t Elapsed = Now - Frame.Start;
+  std::atomic_ref<uint64_t>(Site->Self).fetch_add(Elapsed - std::min(Frame.Children, Elapsed),
+                                                  std::memory_order_relaxed);
+  if (--Stack.Depth[Site->Id - 1] == 0)
+    std::atomic_ref<uint64_t>(Site->Total).fetch_add(Elapsed, std::memory_order_relaxed);
+  if (!Stack.Frames.empty())
+    Stack.Frames.back().Children += Elapsed;
+}
+
+extern "C" void ks_profile_report(int32_t Json) {
+  std::vector<ks_profile_site *> Sites;
+  double CyclesPerMs = 1e6;
+  {
+    std::lock_guard<std::mutex> Lock(ProfileMutex);
+    Sites.swap(ProfileSites);
+    auto Ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - ProfileStartTime);
+    if (!Sites.empty() && Ms.count() > 0)
+      CyclesPerMs = (ReadCycles() - ProfileStartCycles) / Ms.count();
+  }
+  std::sort(Sites.begin(), Sites.end(), [](ks_profile_site *A, ks_profile_site *B) { return A->Self > B->Self; });
+
+  if (Json) {
+    fprintf(stderr, "{\"functions\": [");
+    for (size_t i = 0; i != Sites.size(); ++i) {
+      fprintf(stderr, "%s\n  {\"name\": ", i ? "," : "");
+      PrintJSONString(Sites[i]->Name);
+      fprintf(stderr, ", \"calls\": %" PRIu64 ", \"self_ms\": %.3f, \"total_ms\": %.3f}", Sites[i]->Calls,
+              Sites[i]->Self / CyclesPerMs, Sites[i]->Total / CyclesPerMs);
+    }
+    fprintf(stderr, "\n]}\n");
+    return;
+  }
+  fprintf(stderr, "%12s %12s %12s  %s\n", "calls", "self ms", "total ms", "function");
+  for (auto *Site : Sites)
+    fprintf(stderr, "%12" PRIu64 " %12.3f %12.3f  %s\n", Site->Calls, Site->Self / CyclesPerMs,
+            Site->Total / CyclesPerMs, Site->Name);
+}
\ No newline at end of file
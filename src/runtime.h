@@ -0,0 +1,44 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+#include <cstdint>
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" double putchard(double X);
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+extern "C" double printd(double X);
+
+/// ParForKernel - Outlined body of a parfor loop.  Runs iterations [Lo, Hi)
+/// with the variables captured in Env and returns the reduction of their
+/// values, or 0.0 if the loop does not reduce.
+typedef double (*ParForKernel)(int64_t Lo, int64_t Hi, void *Env);
+
+/// ks_parallel_for - Run Kernel over the iterations [0, Trip) on the
+/// work-stealing thread pool, combining the partial results of the chunks with
+/// ReduceOp ('+', '*', or 0 for none).  Called by code generated for parfor.
+extern "C" double ks_parallel_for(int64_t Trip, ParForKernel Kernel, void *Env, int32_t ReduceOp);
+
+/// ks_profile_site - Counters of one profiled function.  Code generated with
+/// call profiling emits one next to every definition, zero but for Name, and
+/// passes it to ks_profile_enter and ks_profile_exit.  Times are in cycles.
+struct ks_profile_site {
+  const char *Name;
+  uint64_t Calls;
+  uint64_t Self;  // time spent in the function itself
+  uint64_t Total; // time including callees; recursive calls count once
+  uint32_t Id;    // nonzero once the runtime knows the site
+};
+
+/// ks_profile_enter - Count a call of Site and start timing it.
+extern "C" void ks_profile_enter(ks_profile_site *Site);
+
+/// ks_profile_exit - Stop timing the innermost call, which is one of Site.
+extern "C" void ks_profile_exit(ks_profile_site *Site);
+
+/// ks_profile_report - Print the flat profile of every site called so far to
+/// stderr, sorted by self time, as a table or as JSON.  Called once, at exit;
+/// calls made afterwards are not reported.
+extern "C" void ks_profile_report(int32_t Json);
+
+#endif
@@ -0,0 +1,341 @@
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "server.h"
+#include "codegen.h"
+#include "errors.h"
+#include "jit.h"
+#include "parser.h"
+#include "protocol.h"
+#include "toks.h"
+
+namespace {
+
+/// MaxBatch - Most eval requests compiled into one module.
+const size_t MaxBatch = 64;
+
+/// ContextReuse - Modules compiled in a worker's LLVMContext before it is
+/// replaced; constants and types interned in a context are never freed.
+const unsigned ContextReuse = 256;
+
+struct Request {
+  char Kind;
+  std::string Source;
+  std::promise<std::pair<char, std::string>> Reply;
+};
+
+class CompileServer {
+  llvm::orc::JITTargetMachineBuilder JTMB;
+  std::unique_ptr<KaleidoscopeJIT> JIT;
+  std::mutex Mutex;
+  std::condition_variable QueueNotEmpty;
+  std::deque<std::unique_ptr<Request>> Queue;
+
+public:
+  CompileServer(llvm::orc::JITTargetMachineBuilder JTMB, std::unique_ptr<KaleidoscopeJIT> JIT)
+    : JTMB(std::move(JTMB)), JIT(std::move(JIT)) {}
+
+  void Serve(int FD);
+  void Work();
+
+private:
+  std::vector<std::unique_ptr<Request>> NextBatch();
+};
+
+/// Worker - The warm state of a worker thread.
+struct Worker {
+  std::unique_ptr<llvm::TargetMachine> TM;
+  LLVMCodegen Codegen{/*DebugLogging=*/false};
+  unsigned Modules = 0;
+
+  /// StartModule - Start a module with no prototypes.  The context is only
+  /// replaced if MayRecycle, as modules still in use must keep theirs.
+  void StartModule(bool MayRecycle = true) {
+    Codegen.clearFunctionProtos();
+    Codegen.NewModule(TM.get(), /*KeepContext=*/!MayRecycle || ++Modules % ContextReuse != 0);
+  }
+};
+
+/// ParseRequest - Generate code for Source into the current module.  Returns
+/// the function of its first top-level expression, named ExprName if given,
+/// or nullptr with Error set.
+llvm::Function *ParseRequest(LLVMCodegen &Codegen, const std::string &Source, bool AllowDefinitions,
+                             const std::string &ExprName, std::string &Error) {
+  Error.clear();
+  SetErrorSink(&Error);
+  Parser P(std::make_unique<Lexer>(Source));
+  P.AddStandardBinops();
+  P.getNextToken();
+
+  llvm::Function *Expr = nullptr;
+  while (P.CurTok != tok_eof && Error.empty()) {
+    switch (P.CurTok) {
+    case ';': // ignore top-level semicolons.
+      P.getNextToken();
+      break;
+    case tok_def:
+      // Definitions of batched requests would clash.
+      if (!AllowDefinitions) {
+        LogError("definitions are not allowed in eval requests");
+        break;
+      }
+      if (auto FnAST = P.ParseDefinition())
+        FnAST->accept(Codegen);
+      break;
+    case tok_extern:
+      if (auto ProtoAST = P.ParseExtern())
+        if (ProtoAST->accept(Codegen))
+          Codegen.addFunctionProto(ProtoAST->GetName(), std::move(ProtoAST));
+      break;
+    default:
+      if (Expr && !AllowDefinitions) {
+        LogError("expected a single expression");
+        break;
+      }
+      if (auto FnAST = P.ParseTopLevelExpr()) {
+        auto *F = FnAST->accept(Codegen);
+        // Name the expression right away, so that no later one in the module
+        // is generated into it.
+        if (F && !ExprName.empty())
+          F->setName(ExprName);
+        if (!Expr)
+          Expr = F;
+      }
+      break;
+    }
+  }
+  if (Error.empty() && !Expr && !AllowDefinitions)
+    LogError("expected an expression");
+  SetErrorSink(nullptr);
+  return Error.empty() ? Expr : nullptr;
+}
+
+void Respond(Request &R, char Kind, std::string Payload) {
+  R.Reply.set_value({Kind, std::move(Payload)});
+}
+
+/// CompileModule - Optimize the current module of W and emit an object file,
+/// or return nullptr with Error set.
+std::unique_ptr<llvm::MemoryBuffer> CompileModule(Worker &W, std::string &Error) {
+  W.Codegen.OptimizeModule();
+  auto Obj = llvm::orc::SimpleCompiler(*W.TM)(*W.Codegen.getModule());
+  if (!Obj) {
+    Error = llvm::toString(Obj.takeError());
+    return nullptr;
+  }
+  return std::move(*Obj);
+}
+
+void RunCompile(Worker &W, Request &R) {
+  std::string Error;
+  W.StartModule();
+  ParseRequest(W.Codegen, R.Source, /*AllowDefinitions=*/true, "", Error);
+  std::unique_ptr<llvm::MemoryBuffer> Obj;
+  if (Error.empty())
+    Obj = CompileModule(W, Error);
+  if (!Obj)
+    return Respond(R, FK_Error, Error);
+  Respond(R, FK_Object, Obj->getBuffer().str());
+}
+
+/// FindUnresolved - Check that the JIT can resolve every function M calls
+/// but does not define.
+llvm::Error FindUnresolved(KaleidoscopeJIT &JIT, llvm::Module &M) {
+  for (auto &F : M)
+    if (F.isDeclaration() && !F.isIntrinsic() && !F.use_empty())
+      if (auto Addr = JIT.LookupExternal(F.getName()); !Addr)
+        return Addr.takeError();
+  return llvm::Error::success();
+}
+
+/// RunEvalBatch - Compile the expressions of Batch as functions of one module,
+/// link it once and run them.  Every request is generated in a module of its
+/// own first, so that it sees only its own externs and a failed request
+/// leaves nothing behind, and the modules that compiled are linked together.
+void RunEvalBatch(Worker &W, KaleidoscopeJIT &JIT, std::vector<std::unique_ptr<Request>> &Batch) {
+  std::vector<std::string> Names(Batch.size());
+  std::vector<std::unique_ptr<llvm::Module>> Modules(Batch.size());
+  std::string Error;
+  for (size_t i = 0; i != Batch.size(); ++i) {
+    W.StartModule(/*MayRecycle=*/i == 0);
+    std::string Name = "__eval." + std::to_string(i);
+    if (!ParseRequest(W.Codegen, Batch[i]->Source, /*AllowDefinitions=*/false, Name, Error)) {
+      Respond(*Batch[i], FK_Error, Error);
+      continue;
+    }
+    // A symbol missing from the process would fail the object of the batch.
+    if (auto Err = FindUnresolved(JIT, *W.Codegen.getModule())) {
+      Respond(*Batch[i], FK_Error, llvm::toString(std::move(Err)));
+      continue;
+    }
+    Names[i] = std::move(Name);
+    Modules[i] = std::move(W.Codegen.getModule());
+  }
+
+  W.StartModule(/*MayRecycle=*/false);
+  for (size_t i = 0; i != Batch.size(); ++i)
+    if (Modules[i] && llvm::Linker::linkModules(*W.Codegen.getModule(), std::move(Modules[i]))) {
+      Respond(*Batch[i], FK_Error, "cannot link the expression");
+      Names[i].clear();
+    }
+
+  auto FailAll = [&](std::string Message) {
+    for (size_t i = 0; i != Batch.size(); ++i)
+      if (!Names[i].empty())
+        Respond(*Batch[i], FK_Error, Message);
+  };
+  auto Obj = CompileModule(W, Error);
+  if (!Obj)
+    return FailAll(Error);
+  auto JD = JIT.CreateDylib();
+  if (!JD)
+    return FailAll(llvm::toString(JD.takeError()));
+  if (auto Err = JIT.AddObject(*JD, std::move(Obj))) {
+    llvm::consumeError(JIT.RemoveDylib(*JD));
+    return FailAll(llvm::toString(std::move(Err)));
+  }
+
+  for (size_t i = 0; i != Batch.size(); ++i) {
+    if (Names[i].empty())
+      continue;
+    auto Addr = JIT.Lookup(*JD, Names[i]);
+    if (!Addr) {
+      Respond(*Batch[i], FK_Error, llvm::toString(Addr.takeError()));
+      continue;
+    }
+    double Result = reinterpret_cast<double (*)()>(*Addr)();
+    Respond(*Batch[i], FK_Result, std::string(reinterpret_cast<char *>(&Result), sizeof(Result)));
+  }
+  if (auto Err = JIT.RemoveDylib(*JD))
+    llvm::errs() << "Error: " << llvm::toString(std::move(Err)) << "\n";
+}
+
+/// NextBatch - Wait for a request.  An eval request is taken together with
+/// the other eval requests waiting behind it.
+std::vector<std::unique_ptr<Request>> CompileServer::NextBatch() {
+  std::unique_lock<std::mutex> Lock(Mutex);
+  QueueNotEmpty.wait(Lock, [&] { return !Queue.empty(); });
+  std::vector<std::unique_ptr<Request>> Batch;
+  Batch.push_back(std::move(Queue.front()));
+  Queue.pop_front();
+  if (Batch[0]->Kind != FK_Eval)
+    return Batch;
+  for (auto It = Queue.begin(); It != Queue.end() && Batch.size() < MaxBatch;) {
+    if ((*It)->Kind == FK_Eval) {
+      Batch.push_back(std::move(*It));
+      It = Queue.erase(It);
+    } else {
+      ++It;
+    }
+  }
+  return Batch;
+}
+
+void CompileServer::Work() {
+  Worker W;
+  auto TM = JTMB.createTargetMachine();
+  if (!TM) {
+    llvm::errs() << "Error: " << llvm::toString(TM.takeError()) << "\n";
+    return;
+  }
+  W.TM = std::move(*TM);
+
+  while (true) {
+    auto Batch = NextBatch();
+    if (Batch[0]->Kind == FK_Eval)
+      RunEvalBatch(W, *JIT, Batch);
+    else
+      RunCompile(W, *Batch[0]);
+  }
+}
+
+/// Serve - Answer the requests of one client, in order.
+void CompileServer::Serve(int FD) {
+  char Kind;
+  std::string Source;
+  FrameStatus Status;
+  while ((Status = ReadFrame(FD, Kind, Source, MaxRequestSize)) != FS_Closed) {
+    if (Status == FS_TooLarge) {
+      WriteFrame(FD, FK_Error, "request too large");
+      break;
+    }
+    if (Kind != FK_Eval && Kind != FK_Compile) {
+      if (!WriteFrame(FD, FK_Error, "unknown request kind"))
+        break;
+      continue;
+    }
+    auto R = std::make_unique<Request>();
+    R->Kind = Kind;
+    R->Source = std::move(Source);
+    auto Reply = R->Reply.get_future();
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Queue.push_back(std::move(R));
+    }
+    QueueNotEmpty.notify_one();
+
+    auto [ReplyKind, Payload] = Reply.get();
+    if (!WriteFrame(FD, ReplyKind, Payload))
+      break;
+  }
+  close(FD);
+}
+
+} // end anonymous namespace
+
+int RunServer(const std::string &SocketPath, llvm::orc::JITTargetMachineBuilder JTMB, unsigned NumWorkers,
+              JITListeners Listeners) {
+  auto JIT = KaleidoscopeJIT::Create(Listeners);
+  if (!JIT) {
+    llvm::errs() << "Error: " << llvm::toString(JIT.takeError()) << "\n";
+    return 1;
+  }
+
+  sockaddr_un Addr = {};
+  Addr.sun_family = AF_UNIX;
+  if (SocketPath.size() >= sizeof(Addr.sun_path)) {
+    llvm::errs() << "Error: socket path too long\n";
+    return 1;
+  }
+  SocketPath.copy(Addr.sun_path, SocketPath.size());
+  int Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(SocketPath.c_str());
+  if (Listener < 0 || bind(Listener, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) < 0 ||
+      listen(Listener, SOMAXCONN) < 0) {
+    llvm::errs() << "Error: cannot listen on " << SocketPath << ": " << strerror(errno) << "\n";
+    return 1;
+  }
+
+  // The server lives until the process is killed.
+  auto *Server = new CompileServer(std::move(JTMB), std::move(*JIT));
+  for (unsigned i = 0; i != std::max(NumWorkers, 1u); ++i)
+    std::thread([Server] { Server->Work(); }).detach();
+
+  llvm::errs() << "Serving on " << SocketPath << "\n";
+  while (true) {
+    int FD = accept(Listener, nullptr, nullptr);
+    if (FD < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      llvm::errs() << "Error: accept: " << strerror(errno) << "\n";
+      return 1;
+    }
+    std::thread([Server, FD] { Server->Serve(FD); }).detach();
+  }
+}
\ No newline at end of file
@@ -0,0 +1,17 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+
+#include "jit.h"
+
+/// RunServer - Serve compile and eval requests (see protocol.h) on a Unix
+/// socket at SocketPath.  NumWorkers threads each keep a warm target machine
+/// and LLVM context; concurrent eval requests are compiled into one module and
+/// linked together.  Only returns if the socket cannot be served.
+int RunServer(const std::string &SocketPath, llvm::orc::JITTargetMachineBuilder JTMB, unsigned NumWorkers,
+              JITListeners Listeners = {});
+
+#endif
\ No newline at end of file
@@ -0,0 +1,178 @@
+#include <cstring>
+
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "snapshot.h"
+
+namespace {
+
+const char Magic[8] = {'K', 'S', 'S', 'N', 'A', 'P', 0, 0};
+const uint32_t Version = 1;
+
+enum SectionKind { SK_Operators, SK_Prototypes, SK_Bitcode, SK_Object, SK_Target, SK_NumSections };
+
+struct SnapshotHeader {
+  char Magic[8];
+  uint32_t Version;
+  uint32_t Reserved;
+  uint64_t Sections[SK_NumSections][2];  // offset, size
+};
+
+llvm::Error MakeError(const llvm::Twine &Message) {
+  return llvm::createStringError(llvm::inconvertibleErrorCode(), Message);
+}
+
+/// SectionWriter - Builds the contents of a section.
+class SectionWriter {
+  std::string Data;
+
+public:
+  template <typename T> void Write(T V) { Data.append(reinterpret_cast<const char *>(&V), sizeof(V)); }
+  void WriteString(llvm::StringRef S) {
+    Write<uint32_t>(S.size());
+    Data.append(S.data(), S.size());
+  }
+  const std::string &GetData() const { return Data; }
+};
+
+/// SectionReader - Decodes a section, failing on truncated data.
+class SectionReader {
+  llvm::StringRef Data;
+  bool Failed = false;
+
+public:
+  explicit SectionReader(llvm::StringRef Data) : Data(Data) {}
+
+  template <typename T> T Read() {
+    T V{};
+    if (Data.size() < sizeof(T)) {
+      Failed = true;
+      return V;
+    }
+    memcpy(&V, Data.data(), sizeof(T));
+    Data = Data.drop_front(sizeof(T));
+    return V;
+  }
+  std::string ReadString() {
+    uint32_t Size = Read<uint32_t>();
+    if (Data.size() < Size) {
+      Failed = true;
+      return "";
+    }
+    std::string S = Data.take_front(Size).str();
+    Data = Data.drop_front(Size);
+    return S;
+  }
+  bool HasFailed() const { return Failed; }
+};
+
+uint64_t AlignTo8(uint64_t Offset) { return (Offset + 7) & ~uint64_t(7); }
+
+} // end anonymous namespace
+
+llvm::Error WriteSnapshot(llvm::StringRef Path, const Snapshot &S) {
+  SectionWriter Operators;
+  Operators.Write<uint32_t>(S.Precedences.size());
+  for (auto &[Op, Prec] : S.Precedences) {
+    Operators.Write<char>(Op);
+    Operators.Write<int32_t>(Prec);
+  }
+
+  SectionWriter Prototypes;
+  Prototypes.Write<uint32_t>(S.Protos.size());
+  for (auto &Proto : S.Protos) {
+    Prototypes.WriteString(Proto->GetName());
+    auto &Args = Proto->GetArgs();
+    Prototypes.Write<uint32_t>(Args.size());
+    for (unsigned i = 0; i != Args.size(); ++i) {
+      Prototypes.WriteString(Args[i]);
+      Prototypes.Write<uint8_t>(Proto->IsArrayArg(i));
+    }
+    Prototypes.Write<uint8_t>(Proto->IsOperator());
+    Prototypes.Write<uint32_t>(Proto->GetBinaryPrecedence());
+  }
+
+  llvm::StringRef Contents[SK_NumSections] = {Operators.GetData(), Prototypes.GetData(), S.Bitcode, S.Object,
+                                              S.Target};
+  SnapshotHeader Header = {};
+  memcpy(Header.Magic, Magic, sizeof(Magic));
+  Header.Version = Version;
+  uint64_t Offset = AlignTo8(sizeof(Header));
+  for (unsigned i = 0; i != SK_NumSections; ++i) {
+    Header.Sections[i][0] = Offset;
+    Header.Sections[i][1] = Contents[i].size();
+    Offset = AlignTo8(Offset + Contents[i].size());
+  }
+
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_None);
+  if (EC)
+    return MakeError("Could not open file: " + EC.message());
+  OS.write(reinterpret_cast<const char *>(&Header), sizeof(Header));
+  uint64_t Written = sizeof(Header);
+  for (unsigned i = 0; i != SK_NumSections; ++i) {
+    OS.write_zeros(Header.Sections[i][0] - Written);
+    OS << Contents[i];
+    Written = Header.Sections[i][0] + Contents[i].size();
+  }
+  OS.close();
+  if (OS.has_error())
+    return MakeError("Could not write " + Path + ": " + OS.error().message());
+  return llvm::Error::success();
+}
+
+llvm::Expected<Snapshot> ReadSnapshot(llvm::StringRef Path) {
+  // Large files are mapped rather than read.
+  auto Buffer = llvm::MemoryBuffer::getFile(Path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+  if (!Buffer)
+    return MakeError("Could not open " + Path + ": " + Buffer.getError().message());
+  llvm::StringRef File = (*Buffer)->getBuffer();
+
+  SnapshotHeader Header;
+  if (File.size() < sizeof(Header))
+    return MakeError(Path + " is not a snapshot");
+  memcpy(&Header, File.data(), sizeof(Header));
+  if (memcmp(Header.Magic, Magic, sizeof(Magic)) != 0)
+    return MakeError(Path + " is not a snapshot");
+  if (Header.Version != Version)
+    return MakeError(Path + " is a snapshot of another version");
+
+  llvm::StringRef Sections[SK_NumSections];
+  for (unsigned i = 0; i != SK_NumSections; ++i) {
+    uint64_t Offset = Header.Sections[i][0], Size = Header.Sections[i][1];
+    if (Offset > File.size() || Size > File.size() - Offset)
+      return MakeError(Path + " is truncated");
+    Sections[i] = File.substr(Offset, Size);
+  }
+
+  Snapshot S;
+  SectionReader Operators(Sections[SK_Operators]);
+  for (uint32_t i = 0, e = Operators.Read<uint32_t>(); i != e && !Operators.HasFailed(); ++i) {
+    char Op = Operators.Read<char>();
+    S.Precedences[Op] = Operators.Read<int32_t>();
+  }
+
+  SectionReader Prototypes(Sections[SK_Prototypes]);
+  for (uint32_t i = 0, e = Prototypes.Read<uint32_t>(); i != e && !Prototypes.HasFailed(); ++i) {
+    std::string Name = Prototypes.ReadString();
+    std::vector<std::string> Args;
+    std::vector<bool> ArrayArgs;
+    for (uint32_t j = 0, n = Prototypes.Read<uint32_t>(); j != n && !Prototypes.HasFailed(); ++j) {
+      Args.push_back(Prototypes.ReadString());
+      ArrayArgs.push_back(Prototypes.Read<uint8_t>());
+    }
+    bool IsOperator = Prototypes.Read<uint8_t>();
+    unsigned Precedence = Prototypes.Read<uint32_t>();
+    S.Protos.push_back(std::make_unique<PrototypeAST>(Name, std::move(Args), IsOperator, Precedence,
+                                                      std::move(ArrayArgs)));
+  }
+  if (Operators.HasFailed() || Prototypes.HasFailed())
+    return MakeError(Path + " is corrupt");
+
+  S.Bitcode = Sections[SK_Bitcode];
+  S.Object = Sections[SK_Object];
+  S.Target = Sections[SK_Target];
+  S.Buffer = std::move(*Buffer);
+  return S;
+}
\ No newline at end of file
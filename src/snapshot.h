@@ -0,0 +1,46 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include "ast.h"
+
+/// Snapshot - Interpreter state saved after loading a library of definitions:
+/// the binary operator precedences, the prototypes, the module as bitcode and
+/// optionally its machine code for Target ("triple cpu features").
+///
+/// The file is a fixed header followed by the sections it points at:
+///   header     magic "KSSNAP\0\0", version, then (offset, size) pairs of the
+///              operator, prototype, bitcode, object and target sections,
+///              each aligned to 8 bytes
+///   operators  count, then per operator its character and precedence
+///   prototypes count, then per prototype: name, argument count, per argument
+///              its name and array flag, operator flag, precedence
+///   bitcode    the module, before module-level optimization
+///   object     the module compiled for Target, or empty
+/// Strings are a uint32_t length and the bytes; integers are in host order.
+struct Snapshot {
+  std::map<char, int> Precedences;
+  std::vector<std::unique_ptr<PrototypeAST>> Protos;
+  llvm::StringRef Bitcode;
+  llvm::StringRef Object;
+  llvm::StringRef Target;
+  /// Buffer - The mapped file the sections above point into.
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+};
+
+/// WriteSnapshot - Write a snapshot to Path.  Buffer is ignored.
+llvm::Error WriteSnapshot(llvm::StringRef Path, const Snapshot &S);
+
+/// ReadSnapshot - Map the file Path and decode its snapshot.  Only the
+/// prototypes are copied out of the mapping.
+llvm::Expected<Snapshot> ReadSnapshot(llvm::StringRef Path);
+
+#endif
\ No newline at end of file
@@ -18,6 +18,8 @@ enum Token {
   tok_else = -8,
   tok_for = -9,
   tok_in = -10,
+  tok_parfor = -16,
+  tok_reduce = -17,
 
   // operators
   tok_binary = -11,
@@ -25,6 +27,12 @@ enum Token {
 
   // variable
   tok_var = -13,
+
+  // annotations
+  tok_memo = -14,
+
+  // vectors
+  tok_vec = -15,
 };
 
 #endif
\ No newline at end of file
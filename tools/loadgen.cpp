@@ -0,0 +1,155 @@
+// Load generator for `kaleidoscope --server`.  Sends eval (or compile)
+// requests over several connections and reports latency and throughput.
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../src/protocol.h"
+
+static int Connect(const char *Path) {
+  sockaddr_un Addr = {};
+  Addr.sun_family = AF_UNIX;
+  strncpy(Addr.sun_path, Path, sizeof(Addr.sun_path) - 1);
+  int FD = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (FD >= 0 && connect(FD, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) < 0) {
+    close(FD);
+    return -1;
+  }
+  return FD;
+}
+
+/// ParseCount - Parse a decimal count from Min to Max.
+static bool ParseCount(const char *Arg, unsigned long Min, unsigned long Max, unsigned &Count) {
+  char *End;
+  errno = 0;
+  unsigned long Value = strtoul(Arg, &End, 10);
+  if (errno || End == Arg || *End || Arg[0] == '-' || Value < Min || Value > Max)
+    return false;
+  Count = Value;
+  return true;
+}
+
+static int Usage() {
+  fprintf(stderr, "usage: kaleidoscope-loadgen <socket> [-c connections] [-n requests] [-compile | -check]\n");
+  return 1;
+}
+
+/// EvalRequest - The source of eval request I and what it must evaluate to.
+/// With Check, requests that must fail are mixed in, so that batches hold
+/// failing requests next to good ones: a trailing second expression, an
+/// extern the process lacks, and a call relying on another request's extern.
+struct EvalRequest {
+  std::string Source;
+  bool MustFail;
+  double Value;
+};
+
+static EvalRequest MakeEvalRequest(unsigned I, bool Check) {
+  std::string N = std::to_string(I);
+  switch (Check ? I % 5 : 0) {
+  case 1:
+    return {"(" + N + " + 1) * 2 - 3 4", true, 0};
+  case 2:
+    return {"extern sin(x); sin(0) + " + N, false, (double)I};
+  case 3:
+    return {"extern nosuch(); nosuch() + " + N, true, 0};
+  case 4:
+    return {"sin(0) + " + N, true, 0};
+  default:
+    return {"(" + N + " + 1) * 2 - 3", false, 2.0 * I - 1};
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *Path = nullptr;
+  unsigned Connections = 8;
+  unsigned Requests = 10000;
+  bool Compile = false;
+  bool Check = false;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+      if (!ParseCount(argv[++i], 1, 1024, Connections))
+        return Usage();
+    } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      if (!ParseCount(argv[++i], 1, UINT_MAX - 1024, Requests))
+        return Usage();
+    } else if (!strcmp(argv[i], "-compile")) {
+      Compile = true;
+    } else if (!strcmp(argv[i], "-check")) {
+      Check = true;
+    } else if (!Path && argv[i][0] != '-') {
+      Path = argv[i];
+    } else {
+      return Usage();
+    }
+  }
+  if (!Path || (Compile && Check))
+    return Usage();
+
+  // Every request gets its own source so nothing can be cached.
+  std::atomic<unsigned> Next{0}, Errors{0}, Wrong{0};
+  std::vector<std::vector<double>> Latencies(Connections);
+  auto Start = std::chrono::steady_clock::now();
+  std::vector<std::thread> Clients;
+  for (unsigned c = 0; c != Connections; ++c) {
+    Clients.emplace_back([&, c] {
+      int FD = Connect(Path);
+      if (FD < 0) {
+        perror("connect");
+        return;
+      }
+      for (unsigned i; (i = Next++) < Requests;) {
+        EvalRequest Eval = MakeEvalRequest(i, Check);
+        std::string Source = Compile ? "def f(x) x * x + " + std::to_string(i) + ";" : Eval.Source;
+        auto Sent = std::chrono::steady_clock::now();
+        char Kind;
+        std::string Reply;
+        if (!WriteFrame(FD, Compile ? FK_Compile : FK_Eval, Source) || ReadFrame(FD, Kind, Reply) != FS_Ok) {
+          fprintf(stderr, "connection lost\n");
+          break;
+        }
+        std::chrono::duration<double, std::micro> Latency = std::chrono::steady_clock::now() - Sent;
+        Latencies[c].push_back(Latency.count());
+        bool Expected = Eval.MustFail ? Kind == FK_Error
+                                      : Kind == FK_Result && Reply.size() == sizeof(double) &&
+                                          !memcmp(Reply.data(), &Eval.Value, sizeof(double));
+        if (Kind == FK_Error && !Eval.MustFail) {
+          if (!Errors++)
+            fprintf(stderr, "error: %s\n", Reply.c_str());
+        } else if (!Compile && !Expected) {
+          if (!Wrong++)
+            fprintf(stderr, "wrong reply to: %s\n", Source.c_str());
+        }
+      }
+      close(FD);
+    });
+  }
+  for (auto &T : Clients)
+    T.join();
+  std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - Start;
+
+  std::vector<double> All;
+  for (auto &L : Latencies)
+    All.insert(All.end(), L.begin(), L.end());
+  if (All.empty())
+    return 1;
+  std::sort(All.begin(), All.end());
+  auto Percentile = [&](double P) { return All[std::min<size_t>(All.size() - 1, P * All.size())]; };
+  printf("requests: %zu (%u errors, %u wrong replies) over %u connections in %.3f s\n", All.size(), Errors.load(),
+         Wrong.load(), Connections, Elapsed.count());
+  printf("throughput: %.0f req/s\n", All.size() / Elapsed.count());
+  printf("latency: p50 %.0f us, p99 %.0f us, max %.0f us\n", Percentile(0.50), Percentile(0.99), All.back());
+  return Errors || Wrong ? 1 : 0;
+}
\ No newline at end of file